@@ -26,8 +26,15 @@ SOFTWARE.
 
 #include "docdb.h"
 #include "include/disk_document_db.h"
+#include "include/json.h"
 
 DocumentDB& get_instance() {
     static DiskDocumentDB instance;
     return instance;
 }
+
+Extractor json_field(const std::string &path) {
+    return [path](const std::string &data, std::string *key) {
+        return json::get_field(data, path, key);
+    };
+}
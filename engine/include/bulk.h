@@ -0,0 +1,176 @@
+#ifndef ENGINE_INCLUDE_BULK_H_
+#define ENGINE_INCLUDE_BULK_H_
+/*
+MIT License
+
+Copyright (c) 2019 Konstantin Belyavskiy
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "docdb.h"
+#include "fs.h"
+
+namespace bulk {
+
+// External merge sort of a document stream by ID. Documents are buffered
+// up to mem_limit bytes, then sorted and spilled to a run file in tmp_dir.
+// next() yields documents in ID order, the last occurrence of an ID wins.
+class Sorter {
+ public:
+    Sorter(const std::string &tmp_dir, size_t mem_limit)
+        : tmp_dir(tmp_dir), mem_limit(mem_limit) {}
+    ~Sorter();
+    int add(Document *doc);
+    int finish();
+    int next(Document *doc);
+ private:
+    struct Head {
+        Document doc;
+        size_t run;
+    };
+    static bool later(const Head &a, const Head &b) {  // min-heap order
+        return a.doc.id != b.doc.id ? a.doc.id > b.doc.id : a.run > b.run;
+    }
+    int spill();
+    int pop(Document *doc);
+    std::string tmp_dir;
+    size_t mem_limit;
+    size_t buf_bytes = 0;
+    size_t buf_pos = 0;
+    std::vector<Document> buf;
+    std::vector<std::string> runs;
+    std::vector<std::unique_ptr<std::ifstream>> inputs;
+    std::vector<Head> heap;
+};
+
+Sorter::~Sorter() {
+    inputs.clear();
+    for (auto &run : runs)
+        fs::remove_file(run);
+}
+
+int Sorter::add(Document *doc) {
+    buf_bytes += sizeof(Document) + doc->data.size();
+    buf.push_back(std::move(*doc));
+    if (buf_bytes >= mem_limit)
+        return spill();
+    return 0;
+}
+
+int Sorter::spill() {
+    std::stable_sort(buf.begin(), buf.end(),
+                     [](const Document &a, const Document &b) {
+                         return a.id < b.id;
+                     });
+    std::string run = tmp_dir + "/bulk_" + std::to_string(runs.size()) +
+                      ".run";
+    runs.push_back(run);
+    std::ofstream out(run, std::ios::binary | std::ios::trunc);
+    for (auto &doc : buf)
+        if (!write_document(out, doc))
+            break;
+    out.close();
+    if (!out) {
+        std::cerr << "Critical error: can't write " << run << std::endl;
+        return -1;
+    }
+    buf.clear();
+    buf_bytes = 0;
+    return 0;
+}
+
+int Sorter::finish() {
+    if (runs.empty()) {  // fits in memory, no merge needed
+        std::stable_sort(buf.begin(), buf.end(),
+                         [](const Document &a, const Document &b) {
+                             return a.id < b.id;
+                         });
+        return 0;
+    }
+    if (!buf.empty() && spill() != 0)
+        return -1;
+    for (size_t i = 0; i < runs.size(); i++) {
+        inputs.emplace_back(new std::ifstream(runs[i], std::ios::binary));
+        Head head;
+        head.run = i;
+        int ret = read_document(*inputs[i], &head.doc);
+        if (ret < 0)
+            return -1;
+        if (ret > 0) {
+            heap.push_back(std::move(head));
+            std::push_heap(heap.begin(), heap.end(), later);
+        }
+    }
+    return 0;
+}
+
+// Take the smallest document out of the buffer or the merge heap.
+// Returns 1 if a document was taken, 0 if the input is exhausted.
+int Sorter::pop(Document *doc) {
+    if (runs.empty()) {
+        if (buf_pos == buf.size())
+            return 0;
+        *doc = std::move(buf[buf_pos++]);
+        return 1;
+    }
+    if (heap.empty())
+        return 0;
+    std::pop_heap(heap.begin(), heap.end(), later);
+    Head &head = heap.back();
+    *doc = std::move(head.doc);
+    size_t run = head.run;
+    int ret = read_document(*inputs[run], &head.doc);
+    if (ret < 0)
+        return -1;
+    if (ret > 0)
+        std::push_heap(heap.begin(), heap.end(), later);
+    else
+        heap.pop_back();
+    return 1;
+}
+
+int Sorter::next(Document *doc) {
+    int ret = pop(doc);
+    if (ret <= 0)
+        return ret;
+    while (true) {  // skip to the last occurrence of the same ID
+        if (runs.empty()) {
+            if (buf_pos == buf.size() || buf[buf_pos].id != doc->id)
+                break;
+        } else if (heap.empty() || heap.front().doc.id != doc->id) {
+            break;
+        }
+        if (pop(doc) < 0)
+            return -1;
+    }
+    return 1;
+}
+
+}  // namespace bulk
+
+#endif  // ENGINE_INCLUDE_BULK_H_
@@ -0,0 +1,90 @@
+#ifndef ENGINE_INCLUDE_CACHE_H_
+#define ENGINE_INCLUDE_CACHE_H_
+/*
+MIT License
+
+Copyright (c) 2019 Konstantin Belyavskiy
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+#include "docdb.h"
+
+// LRU cache of record payloads, bounded by capacity bytes (payload plus
+// a rough per-entry overhead). Capacity 0 disables it.
+class RecordCache {
+ public:
+    void set_capacity(size_t bytes) {
+        capacity = bytes;
+        evict();
+    }
+    bool get(ID id, std::string *data) {
+        auto it = index.find(id);
+        if (it == index.end())
+            return false;
+        lru.splice(lru.begin(), lru, it->second);  // mark as recently used
+        *data = it->second->second;
+        return true;
+    }
+    void put(ID id, const std::string &data) {
+        erase(id);
+        if (cost(data) > capacity)
+            return;
+        lru.emplace_front(id, data);
+        index[id] = lru.begin();
+        used += cost(data);
+        evict();
+    }
+    void erase(ID id) {
+        auto it = index.find(id);
+        if (it == index.end())
+            return;
+        used -= cost(it->second->second);
+        lru.erase(it->second);
+        index.erase(it);
+    }
+    void clear() {
+        lru.clear();
+        index.clear();
+        used = 0;
+    }
+ private:
+    using Item = std::pair<ID, std::string>;
+    static size_t cost(const std::string &data) {
+        return sizeof(Item) + 4 * sizeof(void*) + data.size();
+    }
+    void evict() {
+        while (used > capacity) {
+            used -= cost(lru.back().second);
+            index.erase(lru.back().first);
+            lru.pop_back();
+        }
+    }
+    size_t capacity = 0;
+    size_t used = 0;
+    std::list<Item> lru;
+    std::unordered_map<ID, std::list<Item>::iterator> index;
+};
+
+#endif  // ENGINE_INCLUDE_CACHE_H_
@@ -24,6 +24,7 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE.
 */
 
+#include <stdint.h>
 #include <string.h>
 
 const int NFILES = 10;
@@ -33,4 +34,36 @@ const int EXT_LEN = strlen(FILE_EXT);
 const int NDIGITS = 20;
 const int FLENGTH = NDIGITS + EXT_LEN;
 
+// FileHeader, files without the magic are legacy ones (no header fields
+// but the entries)
+const uint64_t HDR_MAGIC = 0x3142444344434f44;  // "DOCDCDB1"
+const uint32_t HDR_VERSION = 1;
+// FileHeader::flags
+const uint32_t HDR_ALIGNED = 1;  // header and records are block aligned
+// Entry::flags, stored in the top bit of the entry size on disk
+const uint64_t ENTRY_COMPRESSED = 1;  // record data is an lz block
+const int ENTRY_FLAGS_SHIFT = 63;
+
+// file being rewritten, replaces the original by rename
+const char TMP_EXT[] = ".tmp";
+
+// secondary index sorted and journal files, next to the .db files
+const char INDEX_EXT[] = ".idx";
+const char JOURNAL_EXT[] = ".log";
+// a directory entry per INDEX_PAGE_SIZE bytes of the sorted file, changes
+// are merged into it once they take INDEX_DELTA_MAX bytes of memory
+// (INDEX_BUILD_MAX while building by a scan)
+const size_t INDEX_PAGE_SIZE = 4096;
+const size_t INDEX_DELTA_MAX = 1 << 20;
+const size_t INDEX_BUILD_MAX = 32 << 20;
+
+// records below this size are stored as is when compression is enabled
+const size_t COMPRESS_MIN_SIZE = 64;
+
+// write-back mode: flush a file's buffered changes once the oldest is
+// WB_MAX_AGE_MS old, or everything once the table exceeds WB_MAX_BYTES
+const size_t WB_MAX_BYTES = 4 << 20;
+const int WB_MAX_AGE_MS = 100;
+const int WB_TICK_MS = 10;
+
 #endif  // ENGINE_INCLUDE_CONSTANTS_H_
@@ -45,6 +45,47 @@ class DiskDocumentDB : public DocumentDB {
     int insert(const Document& doc) override {
         return vfs.insert(doc.id, doc.data);
     };
+    int bulk_load(std::istream& in, size_t mem_limit) override {
+        return vfs.bulk_load(in, mem_limit);
+    }
+    int bulk_export(std::ostream& out) const override {
+        return vfs.bulk_export(out);
+    }
+    void set_write_back(bool enable) override {vfs.set_write_back(enable);}
+    int flush() override {return vfs.flush();}
+    void set_direct_io(bool enable, size_t cache_bytes) override {
+        vfs.set_direct_io(enable, cache_bytes);
+    }
+    void set_compression(bool enable) override {
+        vfs.set_compression(enable);
+    }
+    void batch(std::vector<Op>* ops) override {vfs.batch(ops);}
+    void set_log_capacity(size_t max_bytes) override {
+        vfs.set_log_capacity(max_bytes);
+    }
+    int read_log(uint64_t from, size_t max_bytes, int timeout_ms,
+                 std::vector<LogRecord>* out, uint64_t *head) override {
+        return vfs.read_log(from, max_bytes, timeout_ms, out, head);
+    }
+    uint64_t log_head() override {return vfs.log_head();}
+    int snapshot(std::ostream& out, uint64_t *seq) override {
+        return vfs.snapshot(out, seq);
+    }
+    int restore(std::istream& in) override {return vfs.restore(in);}
+    int create_index(const std::string& name, Extractor extract) override {
+        return vfs.create_index(name, extract);
+    }
+    int drop_index(const std::string& name) override {
+        return vfs.drop_index(name);
+    }
+    int find_by(const std::string& index, const std::string& key,
+                std::vector<ID>* ids) const override {
+        return vfs.find_by(index, key, key, true, ids);
+    }
+    int find_by(const std::string& index, const std::string& from,
+                const std::string& to, std::vector<ID>* ids) const override {
+        return vfs.find_by(index, from, to, false, ids);
+    }
  private:
     VFS vfs;
 };
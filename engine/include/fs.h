@@ -32,11 +32,84 @@ SOFTWARE.
 #include <sys/uio.h>
 #include <errno.h>
 
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <mutex>
 #include <vector>
 #include <string>
 
 namespace fs {
 
+const size_t DIRECT_ALIGN = 4096;  // O_DIRECT offset/size/buffer alignment
+const size_t POOL_MAX_BYTES = 16 << 20;  // idle aligned buffers to keep
+
+size_t align_down(size_t n) { return n & ~(DIRECT_ALIGN - 1); }
+size_t align_up(size_t n) { return align_down(n + DIRECT_ALIGN - 1); }
+
+// Reuses DIRECT_ALIGN-aligned buffers, capacities are powers of two
+class BufferPool {
+ public:
+    ~BufferPool() {
+        for (auto &it : idle)
+            for (auto buf : it.second)
+                free(buf);
+    }
+    char *acquire(size_t size, size_t *capacity) {
+        size_t cap = DIRECT_ALIGN;
+        while (cap < size)
+            cap <<= 1;
+        *capacity = cap;
+        {
+            std::lock_guard<std::mutex> l(mtx);
+            auto it = idle.find(cap);
+            if (it != idle.end() && !it->second.empty()) {
+                char *buf = it->second.back();
+                it->second.pop_back();
+                pooled -= cap;
+                return buf;
+            }
+        }
+        void *buf = nullptr;
+        if (posix_memalign(&buf, DIRECT_ALIGN, cap) != 0)
+            return nullptr;
+        return static_cast<char*>(buf);
+    }
+    void release(char *buf, size_t capacity) {
+        std::lock_guard<std::mutex> l(mtx);
+        if (pooled + capacity > POOL_MAX_BYTES) {
+            free(buf);
+            return;
+        }
+        idle[capacity].push_back(buf);
+        pooled += capacity;
+    }
+ private:
+    std::mutex mtx;
+    std::map<size_t, std::vector<char*>> idle;
+    size_t pooled = 0;
+};
+
+BufferPool &buffer_pool() {
+    static BufferPool pool;
+    return pool;
+}
+
+class AlignedBuffer {
+ public:
+    explicit AlignedBuffer(size_t size)
+        : buf(buffer_pool().acquire(size, &capacity)) {}
+    ~AlignedBuffer() {
+        if (buf)
+            buffer_pool().release(buf, capacity);
+    }
+    char *data() { return buf; }
+ private:
+    size_t capacity;
+    char *buf;
+};
+
 std::string current_dir() {
     char cwd[PATH_MAX];
     if (getcwd(cwd, sizeof(cwd)) != NULL) {
@@ -70,8 +143,142 @@ void get_files(const std::string &path, std::vector<std::string> *files) {
     }
 }
 
+// Open with O_DIRECT, falling back to buffered I/O on file systems that
+// don't support it (e.g. tmpfs). Buffers must be aligned either way.
+int open_direct(const std::string &path, int flags) {
+    int fd;
+    while ((fd = open(path.c_str(), flags | O_DIRECT, 0640)) == -1) {
+        if (errno == EINTR)
+            continue;
+        if (errno == EINVAL)
+            break;
+        perror("open");
+        return -1;
+    }
+    while (fd == -1 && (fd = open(path.c_str(), flags, 0640)) == -1) {
+        if (errno == EINTR)
+            continue;
+        perror("open");
+        return -1;
+    }
+    return fd;
+}
+
+// Returns number of bytes read (less than size at the end of file)
+ssize_t pread_full(int fd, char *buf, size_t size, size_t offset) {
+    size_t done = 0;
+    ssize_t ret;
+    while (done < size && (ret = pread(fd, buf + done, size - done,
+                                       offset + done)) != 0) {
+        if (ret == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("pread");
+            return -1;
+        }
+        done += ret;
+    }
+    return done;
+}
+
+int close_file(int fd) {
+    while (close(fd) == -1) {
+        if (errno == EINTR)
+            continue;
+        perror("close");
+        return -1;
+    }
+    return 0;
+}
+
+// Reads whole aligned blocks into a pooled buffer and copies out the range
+int read_direct(const std::string &path, char *buf, size_t size,
+                size_t offset) {
+    int fd = open_direct(path, O_RDONLY);
+    if (fd == -1)
+        return -1;
+    size_t begin = align_down(offset), end = align_up(offset + size);
+    AlignedBuffer block(end - begin);
+    ssize_t n = block.data() ? pread_full(fd, block.data(), end - begin,
+                                          begin) : -1;
+    if (close_file(fd) != 0 || n < 0)
+        return -1;
+    size_t skip = offset - begin;
+    if (static_cast<size_t>(n) > skip)
+        memcpy(buf, block.data() + skip, std::min(size, n - skip));
+    return 0;
+}
+
+// Writes whole aligned blocks; partial head/tail blocks that hold file
+// data are read first (read-modify-write). The file is then cut back to
+// its logical size, so block padding never becomes visible.
+int write_direct(const std::string &path, const char *buf, size_t size,
+                 size_t offset, bool need_truncate, bool need_sync) {
+    int fd = open_direct(path, O_RDWR | O_CREAT);
+    if (fd == -1)
+        return -1;
+    int ret = -1;
+    struct stat info;
+    while (true) {  // goto workaround, in case of error move to the end
+        if (fstat(fd, &info) != 0) {
+            perror("fstat");
+            break;
+        }
+        size_t old_size = info.st_size;
+        size_t begin = align_down(offset), end = align_up(offset + size);
+        if (size) {
+            AlignedBuffer block(end - begin);
+            char *p = block.data();
+            if (!p)
+                break;
+            memset(p, 0, end - begin);
+            size_t last = end - DIRECT_ALIGN;
+            if (offset != begin && begin < old_size &&
+                pread_full(fd, p, DIRECT_ALIGN, begin) < 0)
+                break;
+            if ((offset + size) != end && last < old_size &&
+                (last != begin || offset == begin) &&
+                pread_full(fd, p + last - begin, DIRECT_ALIGN, last) < 0)
+                break;
+            memcpy(p + offset - begin, buf, size);
+            size_t done = 0;
+            ssize_t n;
+            while (done < end - begin) {
+                n = pwrite(fd, p + done, end - begin - done, begin + done);
+                if (n == -1 && errno == EINTR)
+                    continue;
+                if (n == -1)
+                    break;
+                done += n;
+            }
+            if (done < end - begin) {
+                perror("pwrite");
+                break;
+            }
+        }
+        size_t new_size = need_truncate ? offset + size
+                                        : std::max(old_size, offset + size);
+        if (new_size != std::max(old_size, size ? end : 0) &&
+            ftruncate(fd, new_size) != 0) {
+            perror("ftruncate");
+            break;
+        }
+        if (need_sync && fsync(fd) != 0) {
+            perror("fsync");
+            break;
+        }
+        ret = 0;
+        break;
+    }
+    if (close_file(fd) != 0)
+        return -1;
+    return ret;
+}
+
 int read_file(const std::string &path, char *buf, size_t size,
-              size_t offset = 0) {
+              size_t offset = 0, bool direct = false) {
+    if (direct)
+        return read_direct(path, buf, size, offset);
     int fd, ret;
     while ((fd = open(path.c_str(), O_RDWR)) == -1) {
         if (errno == EINTR)
@@ -99,7 +306,11 @@ int read_file(const std::string &path, char *buf, size_t size,
 }
 
 int write_file(const std::string &path, const char *buf, size_t size,
-               size_t offset = 0, bool need_truncate = false) {
+               size_t offset = 0, bool need_truncate = false,
+               bool need_sync = true, bool direct = false) {
+    if (direct)
+        return write_direct(path, buf, size, offset, need_truncate,
+                            need_sync);
     int fd;
     while ((fd = open(path.c_str(), O_RDWR)) == -1) {
         if (errno == EINTR)
@@ -136,7 +347,7 @@ int write_file(const std::string &path, const char *buf, size_t size,
         perror("ftruncate");
         return -1;
     }
-    while (fsync(fd) == -1) {
+    while (need_sync && fsync(fd) == -1) {
         if (errno == EINTR)
             continue;
         perror("fsync");
@@ -151,6 +362,40 @@ int write_file(const std::string &path, const char *buf, size_t size,
     return 0;
 }
 
+// fsync a file or a directory written earlier with need_sync = false
+int sync_file(const std::string &path) {
+    int fd, ret = 0;
+    while ((fd = open(path.c_str(), O_RDONLY)) == -1) {
+        if (errno == EINTR)
+            continue;
+        perror("open");
+        return -1;
+    }
+    while (fsync(fd) == -1) {
+        if (errno == EINTR)
+            continue;
+        perror("fsync");
+        ret = -1;
+        break;
+    }
+    while (close(fd) == -1) {
+        if (errno == EINTR)
+            continue;
+        perror("close");
+        return -1;
+    }
+    return ret;
+}
+
+int64_t file_size(const std::string &path) {
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0) {
+        perror("stat");
+        return -1;
+    }
+    return info.st_size;
+}
+
 int remove_file(const std::string &path) {
     return remove(path.c_str());
 }
@@ -0,0 +1,345 @@
+#ifndef ENGINE_INCLUDE_INDEX_H_
+#define ENGINE_INCLUDE_INDEX_H_
+/*
+MIT License
+
+Copyright (c) 2019 Konstantin Belyavskiy
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "constants.h"
+#include "docdb.h"
+#include "fs.h"
+
+// Secondary index: (key, ID) pairs in key then ID order, kept on disk in
+// a sorted file (<name>.idx, bulk stream format with the key as data)
+// read through a directory of the first key of every INDEX_PAGE_SIZE
+// bytes. Changes go to an append-only journal (<name>.log, keys prefixed
+// by '+' add or '-' remove) and an in-memory delta, which is merged with
+// the sorted file into a new one once it reaches INDEX_DELTA_MAX bytes.
+//
+// The journal is written before the data (synced before the flush in
+// write-back mode), so after a crash it may hold changes the data never
+// got: the caller checks the IDs it mentions against the stored
+// documents on open, see reconcile(). Merging drops the journal, so the
+// caller does it only once the data behind the delta is on disk.
+class SecondaryIndex {
+ public:
+    using Touched = std::map<ID, std::set<std::string>>;
+    SecondaryIndex(const std::string &dir, const std::string &name,
+                   Extractor extract)
+        : dir(dir), base(dir + "/" + name), extract(std::move(extract)) {}
+    // Load the stored index, keys in the journal go to touched by ID.
+    // Returns 1 if there is none.
+    int open(Touched *touched);
+    // Set the keys of a touched document from its stored value (null if
+    // absent), the index must be saved afterwards
+    void reconcile(ID id, const std::set<std::string> &keys,
+                   const std::string *data);
+    // Add a document while building the (empty) index
+    int add(ID id, const std::string &data);
+    // Document id changed from old to now (null if absent)
+    int update(ID id, const std::string *old, const std::string *now,
+               bool need_sync);
+    bool merge_due() const { return delta_bytes >= INDEX_DELTA_MAX; }
+    // Sync the journal, before the data it describes
+    int sync();
+    // IDs with key == from if exact, from <= key < to otherwise (no upper
+    // bound if to is empty), in key then ID order
+    int find(const std::string &from, const std::string &to, bool exact,
+             std::vector<ID> *ids) const;
+    // Merge the delta into the sorted file and drop the journal
+    int save();
+    // Remove the stored files, leaves an empty index
+    void drop();
+
+ private:
+    using Key = std::pair<std::string, ID>;
+    struct Page {
+        Key first;
+        uint64_t offset;
+    };
+    static uint64_t entry_size(const std::string &key) {
+        return sizeof(ID) + sizeof(uint64_t) + key.size();
+    }
+    static int next(std::istream &in, Key *key);
+    void put(Key key, bool present);
+    int merge(const std::string &to);
+    std::string dir, base;
+    Extractor extract;
+    std::string sorted;  // path of the sorted file, empty if none
+    std::vector<Page> pages;
+    std::map<Key, bool> delta;  // false: removed from the sorted file
+    size_t delta_bytes = 0;
+    size_t journal_bytes = 0;
+    size_t synced_bytes = 0;
+};
+
+int SecondaryIndex::next(std::istream &in, Key *key) {
+    Document doc;
+    int ret = read_document(in, &doc);
+    if (ret > 0) {
+        key->first = std::move(doc.data);
+        key->second = doc.id;
+    }
+    return ret;
+}
+
+int SecondaryIndex::open(Touched *touched) {
+    std::string file = base + INDEX_EXT;
+    std::ifstream in(file, std::ios::binary);
+    if (!in)
+        return 1;
+    Key key, prev;
+    uint64_t offset = 0, page_end = 0;
+    int ret;
+    while ((ret = next(in, &key)) > 0) {
+        if (offset > 0 && !(prev < key)) {
+            ret = -1;
+            break;
+        }
+        if (offset >= page_end) {
+            pages.push_back({key, offset});
+            page_end = offset + INDEX_PAGE_SIZE;
+        }
+        offset += entry_size(key.first);
+        prev = std::move(key);
+    }
+    if (ret < 0) {
+        std::cerr << "Critical error: corrupted index " << base << "\n";
+        pages.clear();
+        return 1;
+    }
+    sorted = file;
+    std::ifstream journal(base + JOURNAL_EXT, std::ios::binary);
+    if (!journal)
+        return 0;
+    while (next(journal, &key) > 0 && !key.first.empty()) {
+        journal_bytes += entry_size(key.first);
+        bool present = key.first[0] == '+';
+        key.first.erase(0, 1);
+        (*touched)[key.second].insert(key.first);
+        put(std::move(key), present);
+    }
+    // cut a torn tail (the last append didn't complete) before appending
+    synced_bytes = journal_bytes;
+    return fs::write_file(base + JOURNAL_EXT, nullptr, 0, journal_bytes,
+                          true) == 0 ? 0 : -1;
+}
+
+void SecondaryIndex::reconcile(ID id, const std::set<std::string> &keys,
+                               const std::string *data) {
+    for (auto &key : keys)
+        put(Key(key, id), false);
+    std::string key;
+    if (data && extract(*data, &key))
+        put(Key(std::move(key), id), true);
+}
+
+int SecondaryIndex::add(ID id, const std::string &data) {
+    std::string key;
+    if (extract(data, &key))
+        put(Key(std::move(key), id), true);
+    // merge as it grows, into a file that recover() removes if the build
+    // doesn't complete
+    if (delta_bytes >= INDEX_BUILD_MAX)
+        return merge(base + ".build" + TMP_EXT);
+    return 0;
+}
+
+void SecondaryIndex::put(Key key, bool present) {
+    size_t bytes = sizeof(std::pair<const Key, bool>) + key.first.size();
+    auto ret = delta.emplace(std::move(key), present);
+    if (ret.second)
+        delta_bytes += bytes;
+    else
+        ret.first->second = present;
+}
+
+int SecondaryIndex::update(ID id, const std::string *old,
+                           const std::string *now, bool need_sync) {
+    std::string old_key, new_key;
+    bool had = old && extract(*old, &old_key);
+    bool has = now && extract(*now, &new_key);
+    if (had == has && (!had || old_key == new_key))
+        return 0;
+    std::stringstream buf;
+    if (had) {
+        write_document(buf, {id, "-" + old_key});
+        put(Key(old_key, id), false);
+    }
+    if (has) {
+        write_document(buf, {id, "+" + new_key});
+        put(Key(std::move(new_key), id), true);
+    }
+    std::string rec = buf.str();
+    if (fs::write_file(base + JOURNAL_EXT, rec.data(), rec.size(),
+                       journal_bytes, false, need_sync) != 0)
+        return -1;
+    journal_bytes += rec.size();
+    if (need_sync)
+        synced_bytes = journal_bytes;
+    return 0;
+}
+
+int SecondaryIndex::sync() {
+    if (synced_bytes == journal_bytes)
+        return 0;
+    if (fs::sync_file(base + JOURNAL_EXT) != 0)
+        return -1;
+    synced_bytes = journal_bytes;
+    return 0;
+}
+
+int SecondaryIndex::find(const std::string &from, const std::string &to,
+                         bool exact, std::vector<ID> *ids) const {
+    Key lo(from, std::numeric_limits<ID>::min()), key;
+    auto in_range = [&](const Key &k) {
+        return exact ? k.first == from : to.empty() || k.first < to;
+    };
+    // last page starting at or before lo, then skip to lo in it
+    auto page = std::upper_bound(pages.begin(), pages.end(), lo,
+                                 [](const Key &k, const Page &p) {
+                                     return k < p.first;
+                                 });
+    if (page != pages.begin())
+        --page;
+    std::ifstream in;
+    int ret = 0;
+    if (page != pages.end()) {
+        in.open(sorted, std::ios::binary);
+        if (!in.seekg(page->offset))
+            return -1;
+        while ((ret = next(in, &key)) > 0 && key < lo) {}
+    }
+    auto it = delta.lower_bound(lo);
+    while (true) {
+        bool in_file = ret > 0 && in_range(key);
+        bool in_delta = it != delta.end() && in_range(it->first);
+        if (!in_file && !in_delta)
+            break;
+        if (in_file && (!in_delta || key < it->first)) {
+            ids->push_back(key.second);
+            ret = next(in, &key);
+            continue;
+        }
+        if (in_file && key == it->first)  // delta wins
+            ret = next(in, &key);
+        if (it->second)
+            ids->push_back(it->first.second);
+        ++it;
+    }
+    return ret < 0 ? -1 : 0;
+}
+
+// Write the sorted file merged with the delta to `to` (through a tmp
+// file, so a crash leaves the previous one)
+int SecondaryIndex::merge(const std::string &to) {
+    std::string tmp = base + INDEX_EXT + TMP_EXT;
+    std::ifstream in;
+    if (!sorted.empty()) {
+        in.open(sorted, std::ios::binary);
+        if (!in) {
+            std::cerr << "Critical error: can't read index " << sorted
+                      << "\n";
+            return -1;
+        }
+    }
+    std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+    std::vector<Page> merged;
+    uint64_t offset = 0, page_end = 0;
+    auto emit = [&](const Document &doc) {
+        if (offset >= page_end) {
+            merged.push_back({Key(doc.data, doc.id), offset});
+            page_end = offset + INDEX_PAGE_SIZE;
+        }
+        offset += entry_size(doc.data);
+        write_document(out, doc);
+    };
+    Key key;
+    int ret = sorted.empty() ? 0 : next(in, &key);
+    auto it = delta.begin();
+    while (ret > 0 || it != delta.end()) {
+        if (ret > 0 && (it == delta.end() || key < it->first)) {
+            emit({key.second, std::move(key.first)});
+            ret = next(in, &key);
+            continue;
+        }
+        if (ret > 0 && key == it->first)  // delta wins
+            ret = next(in, &key);
+        if (it->second)
+            emit({it->first.second, it->first.first});
+        ++it;
+    }
+    in.close();
+    out.close();
+    if (ret < 0 || !out ||
+        fs::sync_file(tmp) != 0 || fs::rename_file(tmp, to) != 0 ||
+        fs::sync_file(dir) != 0) {
+        std::cerr << "Critical error: can't write index " << to << "\n";
+        fs::remove_file(tmp);
+        return -1;
+    }
+    if (!sorted.empty() && sorted != to)
+        fs::remove_file(sorted);
+    sorted = to;
+    pages.swap(merged);
+    delta.clear();
+    delta_bytes = 0;
+    return 0;
+}
+
+int SecondaryIndex::save() {
+    std::string file = base + INDEX_EXT;
+    if ((sorted != file || !delta.empty()) && merge(file) != 0)
+        return -1;
+    // journal records are idempotent, replaying them over the merged file
+    // after a crash right here is harmless
+    fs::remove_file(base + JOURNAL_EXT);
+    journal_bytes = 0;
+    synced_bytes = 0;
+    return fs::sync_file(dir);
+}
+
+void SecondaryIndex::drop() {
+    if (!sorted.empty())
+        fs::remove_file(sorted);
+    fs::remove_file(base + INDEX_EXT);
+    fs::remove_file(base + JOURNAL_EXT);
+    sorted.clear();
+    pages.clear();
+    delta.clear();
+    delta_bytes = 0;
+    journal_bytes = 0;
+    synced_bytes = 0;
+}
+
+#endif  // ENGINE_INCLUDE_INDEX_H_
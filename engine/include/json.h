@@ -0,0 +1,201 @@
+#ifndef ENGINE_INCLUDE_JSON_H_
+#define ENGINE_INCLUDE_JSON_H_
+/*
+MIT License
+
+Copyright (c) 2019 Konstantin Belyavskiy
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <cctype>
+#include <cstdint>
+#include <string>
+
+// Minimal JSON scanner, just enough to pull a scalar out of a document
+// for secondary indexes. Nothing is allocated except for the result.
+namespace json {
+
+class Scanner {
+ public:
+    Scanner(const std::string &s): p(s.data()), end(s.data() + s.size()) {}
+    void skip_ws() {
+        while (p < end && isspace(static_cast<unsigned char>(*p)))
+            p++;
+    }
+    bool eat(char c) {
+        skip_ws();
+        if (p == end || *p != c)
+            return false;
+        p++;
+        return true;
+    }
+    // String at p (after ws), unescaped into out if not null
+    bool str(std::string *out) {
+        if (!eat('"'))
+            return false;
+        while (p < end && *p != '"') {
+            char c = *p++;
+            if (c == '\\') {
+                if (p == end)
+                    return false;
+                c = *p++;
+                switch (c) {
+                 case 'n': c = '\n'; break;
+                 case 't': c = '\t'; break;
+                 case 'r': c = '\r'; break;
+                 case 'b': c = '\b'; break;
+                 case 'f': c = '\f'; break;
+                 case 'u':
+                    if (!unicode(out))
+                        return false;
+                    continue;
+                }
+            }
+            if (out)
+                out->push_back(c);
+        }
+        if (p == end)
+            return false;
+        p++;
+        return true;
+    }
+    // \uXXXX escape after the 'u' (a surrogate pair takes two), as UTF-8
+    bool unicode(std::string *out) {
+        uint32_t cp;
+        if (!hex4(&cp))
+            return false;
+        if (cp >= 0xd800 && cp < 0xdc00) {
+            uint32_t low;
+            if (end - p < 2 || p[0] != '\\' || p[1] != 'u')
+                return false;
+            p += 2;
+            if (!hex4(&low) || low < 0xdc00 || low > 0xdfff)
+                return false;
+            cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+        } else if (cp >= 0xdc00 && cp <= 0xdfff) {
+            return false;  // lone low surrogate
+        }
+        if (!out)
+            return true;
+        if (cp < 0x80) {
+            out->push_back(cp);
+        } else if (cp < 0x800) {
+            out->push_back(0xc0 | cp >> 6);
+            out->push_back(0x80 | (cp & 0x3f));
+        } else if (cp < 0x10000) {
+            out->push_back(0xe0 | cp >> 12);
+            out->push_back(0x80 | (cp >> 6 & 0x3f));
+            out->push_back(0x80 | (cp & 0x3f));
+        } else {
+            out->push_back(0xf0 | cp >> 18);
+            out->push_back(0x80 | (cp >> 12 & 0x3f));
+            out->push_back(0x80 | (cp >> 6 & 0x3f));
+            out->push_back(0x80 | (cp & 0x3f));
+        }
+        return true;
+    }
+    bool hex4(uint32_t *v) {
+        if (end - p < 4)
+            return false;
+        *v = 0;
+        for (int i = 0; i < 4; i++, p++) {
+            int c = tolower(static_cast<unsigned char>(*p));
+            if (!isxdigit(c))
+                return false;
+            *v = *v << 4 | (isdigit(c) ? c - '0' : c - 'a' + 10);
+        }
+        return true;
+    }
+    // Skip any value, storing the text of a scalar into out if not null
+    bool value(std::string *out) {
+        skip_ws();
+        if (p == end)
+            return false;
+        if (*p == '"')
+            return str(out);
+        if (*p == '{' || *p == '[') {
+            char close = *p == '{' ? '}' : ']';
+            bool object = *p++ == '{';
+            if (eat(close))
+                return true;
+            do {
+                if (object && (!str(nullptr) || !eat(':')))
+                    return false;
+                if (!value(nullptr))
+                    return false;
+            } while (eat(','));
+            return eat(close);
+        }
+        const char *begin = p;  // number, true, false or null
+        while (p < end && (isalnum(static_cast<unsigned char>(*p)) ||
+                           *p == '-' || *p == '+' || *p == '.'))
+            p++;
+        if (p == begin)
+            return false;
+        if (out)
+            out->assign(begin, p);
+        return true;
+    }
+    // Position at the value of member `name` of the object at p
+    bool member(const std::string &name) {
+        if (!eat('{') || eat('}'))
+            return false;
+        std::string key;
+        do {
+            key.clear();
+            if (!str(&key) || !eat(':'))
+                return false;
+            if (key == name)
+                return true;
+            if (!value(nullptr))
+                return false;
+        } while (eat(','));
+        return false;
+    }
+    bool at_container() {
+        skip_ws();
+        return p < end && (*p == '{' || *p == '[');
+    }
+
+ private:
+    const char *p, *end;
+};
+
+// Scalar at a dot separated path of object members ("address.city").
+// Strings are returned unquoted, numbers and literals as written.
+bool get_field(const std::string &doc, const std::string &path,
+               std::string *value) {
+    Scanner s(doc);
+    size_t pos = 0;
+    while (true) {
+        size_t dot = path.find('.', pos);
+        if (!s.member(path.substr(pos, dot - pos)))
+            return false;
+        if (dot == std::string::npos)
+            break;
+        pos = dot + 1;
+    }
+    value->clear();
+    return !s.at_container() && s.value(value);
+}
+
+}  // namespace json
+
+#endif  // ENGINE_INCLUDE_JSON_H_
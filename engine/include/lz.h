@@ -0,0 +1,169 @@
+#ifndef ENGINE_INCLUDE_LZ_H_
+#define ENGINE_INCLUDE_LZ_H_
+/*
+MIT License
+
+Copyright (c) 2019 Konstantin Belyavskiy
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+// Small LZ77 codec in the spirit of LZ4 block format. A block is the raw
+// size as a varint followed by sequences:
+//   token (4 bits literal length, 4 bits match length - MIN_MATCH),
+//   [literal length extension], literals, [u16 offset,
+//   [match length extension]]
+// A length nibble of 15 is continued by bytes added until one is < 255.
+// The last sequence only has literals.
+
+namespace lz {
+
+const size_t MIN_MATCH = 4;
+const size_t MAX_OFFSET = 0xffff;
+const int HASH_BITS = 12;
+const size_t MAX_INDEXED = size_t(1) << 31;  // literals only past this
+
+uint32_t hash4(const char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return (v * 2654435761U) >> (32 - HASH_BITS);
+}
+
+void put_length(std::string *out, size_t len) {
+    for (; len >= 255; len -= 255)
+        out->push_back(static_cast<char>(255));
+    out->push_back(static_cast<char>(len));
+}
+
+void put_sequence(std::string *out, const char *lit, size_t lit_len,
+                  size_t offset, size_t match_len) {
+    size_t m = match_len ? match_len - MIN_MATCH : 0;
+    out->push_back(static_cast<char>((std::min<size_t>(lit_len, 15) << 4) |
+                                     std::min<size_t>(m, 15)));
+    if (lit_len >= 15)
+        put_length(out, lit_len - 15);
+    out->append(lit, lit_len);
+    if (!match_len)
+        return;
+    out->push_back(static_cast<char>(offset & 0xff));
+    out->push_back(static_cast<char>(offset >> 8));
+    if (m >= 15)
+        put_length(out, m - 15);
+}
+
+void compress(const std::string &src, std::string *out) {
+    out->clear();
+    for (size_t n = src.size(); ; n >>= 7) {  // raw size, varint
+        out->push_back(static_cast<char>((n & 0x7f) | (n > 0x7f ? 0x80 : 0)));
+        if (n <= 0x7f)
+            break;
+    }
+    const char *p = src.data();
+    size_t n = src.size(), anchor = 0, i = 0;
+    size_t indexed = std::min(n, MAX_INDEXED);
+    // Hash table reused across calls without clearing: entries hold
+    // base + position + 1, anything <= base is from an earlier call
+    thread_local uint32_t table[1 << HASH_BITS];
+    thread_local uint32_t base = 0;
+    if (base > UINT32_MAX - indexed - 1) {
+        memset(table, 0, sizeof(table));
+        base = 0;
+    }
+    while (i + MIN_MATCH <= indexed) {
+        uint32_t h = hash4(p + i);
+        uint32_t entry = table[h];
+        table[h] = base + i + 1;
+        size_t cand = entry - base - 1;
+        if (entry <= base || i - cand > MAX_OFFSET ||
+            memcmp(p + cand, p + i, MIN_MATCH) != 0) {
+            i++;
+            continue;
+        }
+        size_t len = MIN_MATCH;
+        while (i + len < n && p[cand + len] == p[i + len])
+            len++;
+        put_sequence(out, p + anchor, i - anchor, i - cand, len);
+        i += len;
+        anchor = i;
+    }
+    base += indexed + 1;
+    put_sequence(out, p + anchor, n - anchor, 0, 0);
+}
+
+// Returns 0 on success, -1 if the block is corrupted
+int decompress(const char *src, size_t size, std::string *out) {
+    const uint8_t *p = reinterpret_cast<const uint8_t*>(src);
+    const uint8_t *end = p + size;
+    uint64_t raw = 0;
+    for (int shift = 0; ; shift += 7) {
+        if (p == end || shift > 63)
+            return -1;
+        raw |= static_cast<uint64_t>(*p & 0x7f) << shift;
+        if (!(*p++ & 0x80))
+            break;
+    }
+    if (raw > 256 * size)  // more than any valid block can expand to
+        return -1;
+    out->clear();
+    out->reserve(raw);
+    auto get_length = [&](size_t *len) {
+        uint8_t b;
+        do {
+            if (p == end)
+                return false;
+            b = *p++;
+            *len += b;
+        } while (b == 255);
+        return true;
+    };
+    while (p < end) {
+        uint8_t token = *p++;
+        size_t lit = token >> 4, match = token & 15;
+        if (lit == 15 && !get_length(&lit))
+            return -1;
+        if (static_cast<size_t>(end - p) < lit || out->size() + lit > raw)
+            return -1;
+        out->append(reinterpret_cast<const char*>(p), lit);
+        p += lit;
+        if (p == end)  // last sequence
+            break;
+        if (end - p < 2)
+            return -1;
+        size_t offset = p[0] | p[1] << 8;
+        p += 2;
+        if (match == 15 && !get_length(&match))
+            return -1;
+        match += MIN_MATCH;
+        if (offset == 0 || offset > out->size() || out->size() + match > raw)
+            return -1;
+        size_t from = out->size() - offset;
+        for (size_t k = 0; k < match; k++)  // may overlap
+            out->push_back((*out)[from + k]);
+    }
+    return out->size() == raw ? 0 : -1;
+}
+
+}  // namespace lz
+
+#endif  // ENGINE_INCLUDE_LZ_H_
@@ -0,0 +1,114 @@
+#ifndef ENGINE_INCLUDE_MUTATION_LOG_H_
+#define ENGINE_INCLUDE_MUTATION_LOG_H_
+/*
+MIT License
+
+Copyright (c) 2019 Konstantin Belyavskiy
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "docdb.h"
+
+// Ordered in-memory log of applied mutations, used to ship them to read
+// replicas. Keeps the newest records up to capacity bytes; a reader that
+// asks for records already dropped has to resync from a snapshot.
+class MutationLog {
+ public:
+    void set_capacity(size_t bytes) {
+        std::lock_guard<std::mutex> l(mtx);
+        capacity = bytes;
+        trim();
+    }
+    void append(OpType type, ID id, const std::string &data) {
+        std::lock_guard<std::mutex> l(mtx);
+        if (capacity == 0) {  // not replicating, just count
+            first_seq = ++next_seq;
+            cv.notify_all();
+            return;
+        }
+        records.push_back({next_seq++, {type, {id, data}, 0}});
+        bytes += cost(records.back());
+        trim();
+        cv.notify_all();
+    }
+    // Drop all records after a change the log can't describe (bulk load,
+    // restore). Skips a seq, so every reader has to resync.
+    void reset() {
+        std::lock_guard<std::mutex> l(mtx);
+        records.clear();
+        bytes = 0;
+        first_seq = ++next_seq;
+    }
+    uint64_t head() {
+        std::lock_guard<std::mutex> l(mtx);
+        return next_seq - 1;
+    }
+    int read(uint64_t from, size_t max_bytes, int timeout_ms,
+             std::vector<LogRecord> *out, uint64_t *head);
+ private:
+    static size_t cost(const LogRecord &rec) {
+        return sizeof(LogRecord) + rec.op.doc.data.size();
+    }
+    void trim() {
+        while (bytes > capacity && !records.empty()) {
+            bytes -= cost(records.front());
+            records.pop_front();
+            first_seq++;
+        }
+    }
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::deque<LogRecord> records;
+    size_t capacity = 0;
+    size_t bytes = 0;
+    uint64_t first_seq = 1;  // seq of records.front()
+    uint64_t next_seq = 1;
+};
+
+// Copy records after seq `from` (at least one, up to max_bytes), waiting
+// up to timeout_ms for new ones. Returns -1 if they are no longer kept.
+int MutationLog::read(uint64_t from, size_t max_bytes, int timeout_ms,
+                      std::vector<LogRecord> *out, uint64_t *head) {
+    std::unique_lock<std::mutex> l(mtx);
+    if (from + 1 < first_seq || from >= next_seq)
+        return -1;
+    if (from + 1 == next_seq)
+        cv.wait_for(l, std::chrono::milliseconds(timeout_ms),
+                    [&]() { return from + 1 != next_seq; });
+    if (from + 1 < first_seq)  // trimmed while waiting
+        return -1;
+    size_t size = 0;
+    for (auto i = from + 1 - first_seq;
+         i < records.size() && (size < max_bytes || out->empty()); i++) {
+        out->push_back(records[i]);
+        size += cost(records[i]);
+    }
+    *head = next_seq - 1;
+    return 0;
+}
+
+#endif  // ENGINE_INCLUDE_MUTATION_LOG_H_
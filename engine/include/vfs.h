@@ -24,14 +24,27 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE.
 */
 
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
 #include <iostream>
+#include <limits>
 #include <vector>
 #include <string>
 #include <unordered_set>
 #include <map>
+#include <memory>
 #include <mutex>
+#include <set>
+#include <thread>
 
 #include "fs.h"
+#include "bulk.h"
+#include "cache.h"
+#include "mutation_log.h"
+#include "lz.h"
+#include "index.h"
 #include "constants.h"
 
 bool check_format(const std::string &name) {
@@ -47,24 +60,116 @@ struct Entry {
     size_t offset;
     size_t size;
     ID id;
+    uint64_t flags;  // ENTRY_* record flags
 };
 
 struct FileHeader {
+    uint64_t magic;    // HDR_MAGIC
+    uint32_t version;  // HDR_VERSION
+    uint32_t flags;    // HDR_* format flags
     Entry header[NFILES];
 };
 
-int read_header(const std::string &path, FileHeader *hdr) {
-    int ret = fs::read_file(path, reinterpret_cast<char*>(hdr),
-                            sizeof(FileHeader));
+// On disk entries stay 24 bytes as in legacy files, Entry::flags are
+// kept in the top bits of size (ENTRY_FLAGS_SHIFT)
+struct DiskEntry {
+    size_t offset;
+    size_t size;
+    ID id;
+};
+
+struct DiskHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t flags;
+    DiskEntry header[NFILES];
+};
+
+// Header of files written before the format was versioned: just the
+// entries. Such files are rewritten on open.
+struct LegacyHeader {
+    DiskEntry header[NFILES];
+};
+
+static_assert(sizeof(DiskEntry) == 24 && sizeof(DiskHeader) == 256,
+              "on-disk header layout changed");
+const size_t HDR_SIZE = sizeof(DiskHeader);  // records start after it
+
+void to_disk(const FileHeader &hdr, DiskHeader *disk) {
+    disk->magic = hdr.magic;
+    disk->version = hdr.version;
+    disk->flags = hdr.flags;
+    for (int i = 0; i < NFILES; i++) {
+        const Entry &e = hdr.header[i];
+        disk->header[i] = {e.offset, e.size | e.flags << ENTRY_FLAGS_SHIFT,
+                           e.id};
+    }
+}
+
+void from_disk(const DiskHeader &disk, FileHeader *hdr) {
+    const size_t size_mask = (size_t(1) << ENTRY_FLAGS_SHIFT) - 1;
+    hdr->magic = disk.magic;
+    hdr->version = disk.version;
+    hdr->flags = disk.flags;
+    for (int i = 0; i < NFILES; i++) {
+        const DiskEntry &e = disk.header[i];
+        hdr->header[i] = {e.offset, e.size & size_mask, e.id,
+                          e.size >> ENTRY_FLAGS_SHIFT};
+    }
+}
+
+void init_header(FileHeader *hdr) {
+    memset(hdr, 0, sizeof(FileHeader));
+    hdr->magic = HDR_MAGIC;
+    hdr->version = HDR_VERSION;
+}
+
+// Record as stored in a file, data is compressed if ENTRY_COMPRESSED is set
+struct Record {
+    ID id;
+    std::string data;
+    uint64_t flags;
+};
+
+int decode_record(const char *p, size_t size, uint64_t flags,
+                  std::string *raw) {
+    if (!(flags & ENTRY_COMPRESSED)) {
+        raw->assign(p, size);
+        return 0;
+    }
+    if (lz::decompress(p, size, raw) != 0) {
+        std::cerr << "Critical error: corrupted compressed record\n";
+        return -1;
+    }
+    return 0;
+}
+
+// Returns 1 for a legacy (unversioned) file, it must not be used as is
+int read_header(const std::string &path, FileHeader *hdr,
+                bool direct = false) {
+    DiskHeader disk;
+    int ret = fs::read_file(path, reinterpret_cast<char*>(&disk),
+                            sizeof(DiskHeader), 0, direct);
     if (ret != 0) {
         std::cerr << "Critical error: can't read " << path << " header\n";
+        return ret;
     }
-    return ret;
+    from_disk(disk, hdr);
+    if (hdr->magic != HDR_MAGIC)
+        return 1;
+    if (hdr->version != HDR_VERSION) {
+        std::cerr << "Critical error: " << path << " has unsupported version "
+                  << hdr->version << "\n";
+        return -1;
+    }
+    return 0;
 }
 
 int write_header(const std::string &path, const FileHeader *hdr) {
-    int ret = fs::write_file(path, reinterpret_cast<const char*>(hdr),
-                             sizeof(FileHeader));
+    DiskHeader disk;
+    to_disk(*hdr, &disk);
+    int ret = fs::write_file(path, reinterpret_cast<const char*>(&disk),
+                             sizeof(DiskHeader));
     if (ret != 0) {
         std::cerr << "Critical error: can't write " << path << " header\n";
     }
@@ -82,29 +187,106 @@ using std::lock_guard;
 using ID = int64_t;
 enum class Opp { INSERT, UPDATE, DELETE };
 
+using steady_clock = std::chrono::steady_clock;
+
+// Buffered mutation, waiting in the dirty table for the flusher
+struct Pending {
+    bool deleted;
+    std::string data;
+    steady_clock::time_point since;  // first buffered after last flush
+};
+
 class VFS {
  public:
     VFS(): path(fs::current_dir() + "/db") { recover(); }
+    ~VFS() { set_write_back(false); }
     bool exists(ID id) const {
         return get(id, empty, false) == 0 ? true : false;
     }
     int get(ID, std::string&, bool read = true) const;
-    int remove(ID id) { return do_magic(id, Opp::DELETE, empty); }
+    int remove(ID id) { return mutate(id, Opp::DELETE, empty); }
     int update(ID id, const std::string &data) {
-        return do_magic(id, Opp::UPDATE, data);
+        return mutate(id, Opp::UPDATE, data);
     }
     int insert(ID id, const std::string &data) {
-        return do_magic(id, Opp::INSERT, data);
+        return mutate(id, Opp::INSERT, data);
     }
+    int bulk_load(std::istream&, size_t mem_limit);
+    int bulk_export(std::ostream&) const;
+    void set_write_back(bool);
+    int flush();
+    void set_direct_io(bool, size_t cache_bytes);
+    void set_compression(bool enable) {
+        lock_guard<recursive_mutex> l(mtx);
+        compression = enable;
+    }
+    void batch(std::vector<Op>*);
+    void set_log_capacity(size_t max_bytes) { log.set_capacity(max_bytes); }
+    int read_log(uint64_t from, size_t max_bytes, int timeout_ms,
+                 std::vector<LogRecord> *out, uint64_t *head) {
+        return log.read(from, max_bytes, timeout_ms, out, head);
+    }
+    uint64_t log_head() { return log.head(); }
+    int snapshot(std::ostream&, uint64_t *seq);
+    int restore(std::istream&);
+    int create_index(const std::string &name, Extractor);
+    int drop_index(const std::string &name);
+    int find_by(const std::string &index, const std::string &from,
+                const std::string &to, bool exact, std::vector<ID>*) const;
  private:
     ID find_file(ID) const;
+    int read_disk(ID, std::string&, bool read) const;
+    int mutate(ID, Opp, const std::string&);
+    int apply(ID, Opp, const std::string&);
     int do_magic(ID, Opp, const std::string&);
+    void encode(ID, const std::string&, Record*) const;
+    int load_file(ID, std::vector<Record>*) const;
+    int write_packed(const Record*, int, bool need_sync, bool tmp = false);
+    int flush_dirty(bool all);
+    void merge_pending(std::vector<Record>*,
+                       std::map<ID, Pending>::const_iterator,
+                       std::map<ID, Pending>::const_iterator) const;
+    int apply_pending(ID, std::map<ID, Pending>::iterator,
+                      std::map<ID, Pending>::iterator);
+    int copy_range(ID first, ID last, std::vector<Record>*) const;
+    void flusher();
+    int build_indexes(const std::vector<SecondaryIndex*>&);
+    int rebuild_indexes();
+    void index_change(ID, const std::string *old, const std::string *now);
+    void merge_indexes();
+    void clear_indexes();
+    void drop_stored_indexes();
     void recover();
+    int open_file(ID);
+    int migrate_file(ID);
+    void trim_files();
     void recover_file(const std::string&);
     std::string path;
     mutable recursive_mutex mtx;
     std::map<ID, int> space;  // keep number of entries in closest DB file
     mutable std::string empty = "";  // place holder
+    // write-back mode: dirty table sorted by ID, so consecutive entries
+    // with the same find_file() target form one group
+    bool write_back = false;
+    std::map<ID, Pending> dirty;
+    size_t dirty_bytes = 0;
+    std::thread flush_thread;
+    std::mutex flush_mtx;  // protects stop_flusher, used by flush_cv
+    std::condition_variable flush_cv;
+    bool stop_flusher = false;
+    // direct I/O mode: O_DIRECT reads/writes, aligned files (HDR_ALIGNED),
+    // and an LRU record cache instead of the kernel page cache
+    bool direct_io = false;
+    mutable RecordCache cache;
+    // compress records of COMPRESS_MIN_SIZE bytes and more on write
+    bool compression = false;
+    // applied mutations in order, for replication (own lock, so readers
+    // waiting for new records don't hold mtx)
+    MutationLog log;
+    // secondary indexes, kept up to date by mutate(); stored_indexes are
+    // found on disk but not declared yet and dropped on the first change
+    std::map<std::string, std::unique_ptr<SecondaryIndex>> indexes;
+    std::set<std::string> stored_indexes;
 };
 
 ID VFS::find_file(ID id) const {
@@ -117,6 +299,21 @@ ID VFS::find_file(ID id) const {
 
 int VFS::get(ID id, std::string &data, bool read) const {
     lock_guard<recursive_mutex> l(mtx);
+    auto it = dirty.find(id);
+    if (it != dirty.end()) {
+        if (it->second.deleted)
+            return -1;
+        if (read)
+            data = it->second.data;
+        return 0;
+    }
+    return read_disk(id, data, read);
+}
+
+int VFS::read_disk(ID id, std::string &data, bool read) const {
+    lock_guard<recursive_mutex> l(mtx);
+    if (read && cache.get(id, &data))
+        return 0;
     ID file_id = find_file(id);
     if (file_id < 0)
         return -1;
@@ -126,7 +323,7 @@ int VFS::get(ID id, std::string &data, bool read) const {
         return -1;
     }
     FileHeader hdr;
-    if (read_header(fullpath, &hdr) == 0) {
+    if (read_header(fullpath, &hdr, direct_io) == 0) {
         for (int i = 0; i < NFILES; i++) {
             if (hdr.header[i].offset == 0 || hdr.header[i].id > id) {
                 break;
@@ -135,9 +332,12 @@ int VFS::get(ID id, std::string &data, bool read) const {
                     size_t size = hdr.header[i].size;
                     size_t offset = hdr.header[i].offset;
                     std::vector<char> cbuf(size);
-                    if (fs::read_file(fullpath, cbuf.data(), size, offset) != 0)
+                    if (fs::read_file(fullpath, cbuf.data(), size, offset,
+                                      direct_io) != 0 ||
+                        decode_record(cbuf.data(), size, hdr.header[i].flags,
+                                      &data) != 0)
                         return -1;
-                    data = std::string(cbuf.data(), size);
+                    cache.put(id, data);
                 }
                 return 0;
             }
@@ -146,9 +346,69 @@ int VFS::get(ID id, std::string &data, bool read) const {
     return -1;
 }
 
-int VFS::do_magic(ID id, Opp opp, const std::string &data) {
+int VFS::mutate(ID id, Opp opp, const std::string &data) {
+    lock_guard<recursive_mutex> l(mtx);
+    drop_stored_indexes();
+    std::string old;  // previous value, to remove its index keys
+    bool had_old = !indexes.empty() && get(id, old) == 0;
+    cache.erase(id);
+    OpType type = opp == Opp::INSERT ? OpType::INSERT :
+                  opp == Opp::UPDATE ? OpType::UPDATE : OpType::REMOVE;
+    const std::string *now = opp == Opp::DELETE ? nullptr : &data;
+    if (!write_back) {
+        // index journals go first, reconciled with the data on open
+        index_change(id, had_old ? &old : nullptr, now);
+        int ret = apply(id, opp, data);
+        if (ret != 0) {
+            index_change(id, now, had_old ? &old : nullptr);
+            return ret;
+        }
+        log.append(type, id, data);
+        merge_indexes();
+        return 0;
+    }
+    if (opp == Opp::DELETE && !exists(id))
+        return -1;  // error, no entry found
+    log.append(type, id, data);
+    index_change(id, had_old ? &old : nullptr, now);
+    auto it = dirty.find(id);
+    if (it == dirty.end()) {
+        it = dirty.emplace(id, Pending{false, "", steady_clock::now()}).first;
+    } else {
+        dirty_bytes -= sizeof(Pending) + it->second.data.size();
+    }
+    it->second.deleted = (opp == Opp::DELETE);
+    it->second.data = data;
+    dirty_bytes += sizeof(Pending) + data.size();
+    merge_indexes();
+    if (dirty_bytes >= 2 * WB_MAX_BYTES)  // flusher is behind, push back
+        return flush_dirty(true);
+    if (dirty_bytes >= WB_MAX_BYTES)
+        flush_cv.notify_one();
+    return 0;
+}
+
+// Apply a single mutation to disk. do_magic shifts data in place and
+// produces byte-packed files, so in direct I/O mode the file is rewritten
+// through the aligned merge path instead.
+int VFS::apply(ID id, Opp opp, const std::string &data) {
+    if (!direct_io)
+        return do_magic(id, opp, data);
+    if (opp == Opp::DELETE && read_disk(id, empty, false) != 0)
+        return -1;  // error, no entry found
+    std::map<ID, Pending> change;
+    change.emplace(id, Pending{opp == Opp::DELETE, data, steady_clock::now()});
+    return apply_pending(find_file(id), change.begin(), change.end());
+}
+
+int VFS::do_magic(ID id, Opp opp, const std::string &raw) {
     lock_guard<recursive_mutex> l(mtx);
-    if (exists(id) > 0) {  // to optimize, if found, store header.
+    Record rec = {id, "", 0};
+    if (opp != Opp::DELETE)
+        encode(id, raw, &rec);
+    const std::string &data = rec.data;  // as stored
+    // to optimize, if found, store header
+    if (read_disk(id, empty, false) == 0) {
         if (opp == Opp::INSERT)
             opp = Opp::UPDATE;
     } else {
@@ -164,6 +424,7 @@ int VFS::do_magic(ID id, Opp opp, const std::string &data) {
     bool read_write_after = true;  // move data after insert/update/delete row
     bool truncate = true;
     int pos_shift = 0;
+    int moved = 0;  // entries moved from src to a new dst file
     FileHeader *srcHdr = nullptr, *dstHdr = nullptr;
     int ret = -1;  // an error by default
     std::vector<char> cbuf;
@@ -194,15 +455,17 @@ int VFS::do_magic(ID id, Opp opp, const std::string &data) {
             write_etry_new = false;
             break;
         }
-        size_t hdr_size = sizeof(FileHeader);
+        size_t hdr_size = HDR_SIZE;
         if (src.length() != 0)
             srcHdr = new FileHeader;
         dstHdr = (dst == src) ? srcHdr : new FileHeader;
         if (srcHdr)
             if (read_header(src, srcHdr) != 0)
                 break;
-        if (dstHdr != srcHdr)  // initialize with zero
-            memset(dstHdr, 0, hdr_size);
+        if (srcHdr)  // shifted data loses block alignment, if any
+            srcHdr->flags &= ~HDR_ALIGNED;
+        if (dstHdr != srcHdr)  // new file
+            init_header(dstHdr);
         if (opp == Opp::DELETE) {
             if (space[file_id] < 2) {
                 assert(space[file_id] == 1);
@@ -230,16 +493,18 @@ int VFS::do_magic(ID id, Opp opp, const std::string &data) {
                 assert(srcHdr->header[next_pos-1].id == id);
         }
         size_t bytes = 0;  // how much data to move, if any
-        if (read_write_after) {
+        if (read_write_after) {  // whole extent, incl. alignment padding
             for (int i = next_pos; i < NFILES; i++) {
                 if (srcHdr->header[i].offset == 0)
                     break;
-                bytes += srcHdr->header[i].size;
+                bytes = srcHdr->header[i].offset + srcHdr->header[i].size -
+                        srcHdr->header[next_pos].offset;
             }
         }
         int dst_pos = (src == dst) ? (next_pos - 1 + pos_shift) : 0;
-        if (read_write_after && bytes == 0)
-            read_write_after = false;  // nothing to write
+        if (read_write_after && (next_pos == NFILES ||
+                                 srcHdr->header[next_pos].offset == 0))
+            read_write_after = false;  // no entries after, nothing to move
         size_t offset;
         int shift;
         // At first read data (to move) if any
@@ -289,11 +554,16 @@ int VFS::do_magic(ID id, Opp opp, const std::string &data) {
                         sizeof(Entry) * n_rows);
             else if (shift)  // update size (INSERT/UPDATE)
                 dstHdr->header[dst_pos].size = data.size();
-            if (opp == Opp::INSERT && src == dst)
+            if (opp == Opp::INSERT && src == dst) {  // takes next's old place
+                dstHdr->header[dst_pos].offset =
+                    dstHdr->header[dst_pos + 1].offset - shift;
+                dstHdr->header[dst_pos].size = data.size();
                 dstHdr->header[dst_pos].id = id;
+            }
             if (opp == Opp::INSERT && src != dst) {  // invalidate src's entries
                 for (int i = next_pos; i < NFILES; i++)
                     srcHdr->header[i].offset = 0;
+                moved = n_rows;
             }
         } else if (opp == Opp::INSERT && src == dst) {
             dstHdr->header[dst_pos].offset = dstHdr->header[dst_pos-1].offset
@@ -301,6 +571,8 @@ int VFS::do_magic(ID id, Opp opp, const std::string &data) {
             dstHdr->header[dst_pos].size = data.size();
             dstHdr->header[dst_pos].id = id;
         }
+        if (write_etry_new)
+            dstHdr->header[dst_pos].flags = rec.flags;
         if (opp == Opp::DELETE)  // invalidate last entry
             dstHdr->header[dst_pos + n_rows].offset = 0;
         // Write updated header(s)
@@ -334,10 +606,13 @@ int VFS::do_magic(ID id, Opp opp, const std::string &data) {
     }
     // resource deallocation and error handling
     if (opp == Opp::INSERT) {
-        if (src == dst)
+        if (src == dst) {
             space[file_id]++;
-        else
-            space[id] = 1;
+        } else {
+            space[id] = 1 + moved;
+            if (moved)
+                space[file_id] -= moved;
+        }
     }
     if (opp == Opp::DELETE && space.count(file_id))
         space[file_id]--;
@@ -356,35 +631,709 @@ int VFS::do_magic(ID id, Opp opp, const std::string &data) {
     return 0;
 }
 
+// Compress the record if enabled, large enough and it actually pays off
+void VFS::encode(ID id, const std::string &raw, Record *rec) const {
+    rec->id = id;
+    rec->flags = 0;
+    if (compression && raw.size() >= COMPRESS_MIN_SIZE) {
+        lz::compress(raw, &rec->data);
+        if (rec->data.size() < raw.size()) {
+            rec->flags |= ENTRY_COMPRESSED;
+            return;
+        }
+    }
+    rec->data = raw;
+}
+
+// Read all records of a file (as stored) with a single data read
+int VFS::load_file(ID file_id, std::vector<Record> *recs) const {
+    std::string fullpath = get_fullpath(file_id, path);
+    FileHeader hdr;
+    if (read_header(fullpath, &hdr, direct_io) != 0)
+        return -1;
+    int n = 0;
+    while (n < NFILES && hdr.header[n].offset != 0)
+        n++;
+    if (n == 0)
+        return 0;
+    size_t begin = hdr.header[0].offset;
+    size_t end = hdr.header[n - 1].offset + hdr.header[n - 1].size;
+    std::vector<char> cbuf(end - begin);
+    if (fs::read_file(fullpath, cbuf.data(), cbuf.size(), begin,
+                      direct_io) != 0)
+        return -1;
+    for (int i = 0; i < n; i++) {
+        const char *p = cbuf.data() + hdr.header[i].offset - begin;
+        recs->push_back({hdr.header[i].id,
+                         std::string(p, hdr.header[i].size),
+                         hdr.header[i].flags});
+    }
+    return 0;
+}
+
+// Build the image of a file holding up to NFILES records
+void pack_file(const Record *recs, int n, bool aligned, std::string *image) {
+    assert(n > 0 && n <= NFILES);
+    FileHeader hdr;
+    init_header(&hdr);
+    auto span = [aligned](size_t size) {
+        return aligned ? fs::align_up(size) : size;
+    };
+    size_t offset = span(HDR_SIZE);
+    for (int i = 0; i < n; i++) {
+        hdr.header[i].offset = offset;
+        hdr.header[i].size = recs[i].data.size();
+        hdr.header[i].id = recs[i].id;
+        hdr.header[i].flags = recs[i].flags;
+        offset += span(recs[i].data.size());
+    }
+    if (aligned)
+        hdr.flags |= HDR_ALIGNED;
+    image->assign(offset, '\0');
+    DiskHeader disk;
+    to_disk(hdr, &disk);
+    memcpy(&(*image)[0], &disk, sizeof(DiskHeader));
+    for (int i = 0; i < n; i++)
+        memcpy(&(*image)[hdr.header[i].offset], recs[i].data.data(),
+               recs[i].data.size());
+}
+
+// Write up to NFILES sorted records as a new file named after the first one
+// (+ TMP_EXT if tmp). In direct I/O mode the header and every record start
+// on a block boundary.
+int VFS::write_packed(const Record *recs, int n, bool need_sync, bool tmp) {
+    std::string image;
+    pack_file(recs, n, direct_io, &image);
+    std::string fullpath = get_fullpath(recs[0].id, path);
+    if (tmp)
+        fullpath += TMP_EXT;
+    if (fs::write_file(fullpath, image.data(), image.size(), 0, true,
+                       need_sync, direct_io) != 0) {
+        std::cerr << "Critical error: can't write " << fullpath << "\n";
+        return -1;
+    }
+    return 0;
+}
+
+int VFS::bulk_load(std::istream &in, size_t mem_limit) {
+    lock_guard<recursive_mutex> l(mtx);
+    if (mem_limit == 0) {  // would spill a run file per document
+        std::cerr << "bulk_load: mem_limit must be positive" << std::endl;
+        return -1;
+    }
+    if (flush_dirty(true) != 0)
+        return -1;
+    cache.clear();
+    bulk::Sorter sorter(path, mem_limit);
+    Document doc;
+    int ret;
+    while ((ret = read_document(in, &doc)) > 0) {
+        if (doc.id < 0) {
+            std::cerr << "bulk_load: invalid id " << doc.id << std::endl;
+            return -1;
+        }
+        if (sorter.add(&doc) != 0)
+            return -1;
+    }
+    if (ret < 0 || sorter.finish() != 0)
+        return -1;
+    // The data changes from here on: drop the stored indexes so a crash
+    // doesn't leave stale ones, and rebuild them whatever the outcome
+    clear_indexes();
+    // not logged: followers can't catch up from the log past this point,
+    // even if the load fails halfway
+    log.reset();
+    if (!space.empty()) {
+        // Packed files would overlap existing ranges, insert one by one
+        // (still in ID order, so files are filled without extra splits).
+        while ((ret = sorter.next(&doc)) > 0)
+            if (apply(doc.id, Opp::INSERT, doc.data) != 0)
+                break;
+        if (rebuild_indexes() != 0)
+            return -1;
+        return ret == 0 ? 0 : -1;
+    }
+    std::map<ID, int> loaded;
+    std::vector<Record> recs;
+    recs.reserve(NFILES);
+    // Files written so far aren't in space yet, don't leave them behind
+    auto fail = [&]() {
+        for (auto &it : loaded)
+            fs::remove_file(get_fullpath(it.first, path));
+        if (!recs.empty())
+            fs::remove_file(get_fullpath(recs[0].id, path));
+        rebuild_indexes();
+        return -1;
+    };
+    while (true) {
+        ret = sorter.next(&doc);
+        if (ret < 0)
+            return fail();
+        if (ret > 0) {
+            recs.emplace_back();
+            encode(doc.id, doc.data, &recs.back());
+        }
+        if (static_cast<int>(recs.size()) == NFILES ||
+            (ret == 0 && !recs.empty())) {
+            if (write_packed(recs.data(), recs.size(), false) != 0)
+                return fail();
+            loaded[recs[0].id] = recs.size();
+            recs.clear();
+        }
+        if (ret == 0)
+            break;
+    }
+    // Single fsync pass over everything written, then the directory itself
+    for (auto &it : loaded)
+        if (fs::sync_file(get_fullpath(it.first, path)) != 0)
+            return fail();
+    if (fs::sync_file(path) != 0)
+        return fail();
+    space.swap(loaded);
+    return rebuild_indexes();
+}
+
+// Holds the lock for the whole export to produce a consistent snapshot,
+// buffered write-back changes are merged in on the fly.
+int VFS::bulk_export(std::ostream &out) const {
+    lock_guard<recursive_mutex> l(mtx);
+    std::vector<Record> recs;
+    Document doc;
+    auto pending = dirty.cbegin();
+    auto write_pending = [&out](std::map<ID, Pending>::const_iterator it) {
+        return it->second.deleted ||
+               write_document(out, {it->first, it->second.data});
+    };
+    for (auto &it : space) {
+        recs.clear();
+        if (load_file(it.first, &recs) != 0)
+            return -1;
+        for (auto &rec : recs) {
+            doc.id = rec.id;
+            if (decode_record(rec.data.data(), rec.data.size(), rec.flags,
+                              &doc.data) != 0)
+                return -1;
+            for (; pending != dirty.cend() && pending->first < doc.id;
+                 ++pending)
+                if (!write_pending(pending))
+                    return -1;
+            if (pending != dirty.cend() && pending->first == doc.id) {
+                if (!write_pending(pending++))  // replaced or deleted
+                    return -1;
+            } else if (!write_document(out, doc)) {
+                return -1;
+            }
+        }
+    }
+    for (; pending != dirty.cend(); ++pending)
+        if (!write_pending(pending))
+            return -1;
+    out.flush();
+    return out ? 0 : -1;
+}
+
+// Apply buffered changes to records sorted by ID
+void VFS::merge_pending(std::vector<Record> *recs,
+                        std::map<ID, Pending>::const_iterator first,
+                        std::map<ID, Pending>::const_iterator last) const {
+    std::vector<Record> merged;
+    auto rec = recs->begin();  // kept as stored, no recompression
+    for (auto it = first; it != last; ++it) {
+        while (rec != recs->end() && rec->id < it->first)
+            merged.push_back(std::move(*rec++));
+        if (rec != recs->end() && rec->id == it->first)
+            ++rec;  // replaced or deleted
+        if (!it->second.deleted) {
+            merged.emplace_back();
+            encode(it->first, it->second.data, &merged.back());
+        }
+    }
+    while (rec != recs->end())
+        merged.push_back(std::move(*rec++));
+    recs->swap(merged);
+}
+
+// Apply pending changes [first, last) that all belong to file_id (-1 for
+// IDs below the first file): the file is read once, merged in memory and
+// rewritten as packed file(s), one header+data write per output file.
+int VFS::apply_pending(ID file_id, std::map<ID, Pending>::iterator first,
+                       std::map<ID, Pending>::iterator last) {
+    std::vector<Record> merged;
+    if (file_id >= 0 && load_file(file_id, &merged) != 0)
+        return -1;
+    merge_pending(&merged, first, last);
+    int n = merged.size();
+    int nfiles = (n + NFILES - 1) / NFILES;
+    std::vector<int> bounds;  // spread evenly
+    for (int i = 0; nfiles > 0 && i <= nfiles; i++)
+        bounds.push_back(n * i / nfiles);
+    // New files first, the original file is replaced (tmp + rename) or
+    // removed last: a crash in between leaves all records in the original,
+    // recover() then drops its tail copied to the new files.
+    int reused = -1;
+    std::vector<ID> written;
+    auto fail = [&]() {
+        for (ID id : written)
+            fs::remove_file(get_fullpath(id, path));
+        return -1;
+    };
+    for (int i = 0; i < nfiles; i++) {
+        const Record *first = &merged[bounds[i]];
+        if (first->id == file_id) {
+            reused = i;
+            continue;
+        }
+        if (write_packed(first, bounds[i + 1] - bounds[i], true) != 0)
+            return fail();
+        written.push_back(first->id);
+    }
+    if (!written.empty() && fs::sync_file(path) != 0)
+        return fail();
+    std::string fullpath = get_fullpath(file_id, path);
+    if (reused >= 0) {
+        int count = bounds[reused + 1] - bounds[reused];
+        if (write_packed(&merged[bounds[reused]], count, true, true) != 0 ||
+            fs::rename_file(fullpath + TMP_EXT, fullpath) != 0)
+            return fail();
+    } else if (file_id >= 0 && fs::remove_file(fullpath) != 0) {
+        return fail();
+    }
+    if (file_id >= 0)
+        space.erase(file_id);
+    for (int i = 0; i < nfiles; i++)
+        space[merged[bounds[i]].id] = bounds[i + 1] - bounds[i];
+    return fs::sync_file(path);
+}
+
+// Flush all groups (all = true), or only those holding an entry older
+// than WB_MAX_AGE_MS, unless the table has grown above WB_MAX_BYTES.
+int VFS::flush_dirty(bool all) {
+    lock_guard<recursive_mutex> l(mtx);
+    if (dirty_bytes >= WB_MAX_BYTES)
+        all = true;
+    auto deadline = steady_clock::now() -
+                    std::chrono::milliseconds(WB_MAX_AGE_MS);
+    // index journal records reach the disk before the data they describe
+    for (auto &it : indexes)
+        if (!dirty.empty() && it.second->sync() != 0)
+            return -1;
+    int ret = 0;
+    auto first = dirty.begin();
+    while (first != dirty.end()) {
+        ID file_id = find_file(first->first);
+        auto next_file = space.upper_bound(first->first);
+        auto last = (next_file == space.end()) ? dirty.end()
+                                               : dirty.lower_bound(
+                                                     next_file->first);
+        bool expired = all;
+        for (auto it = first; !expired && it != last; ++it)
+            expired = it->second.since <= deadline;
+        if (!expired) {
+            first = last;
+            continue;
+        }
+        if (apply_pending(file_id, first, last) != 0) {
+            std::cerr << "Critical error: can't flush changes for file "
+                      << get_fullpath(file_id, path) << "\n";
+            ret = -1;
+            first = last;
+            continue;
+        }
+        for (auto it = first; it != last; ++it)
+            dirty_bytes -= sizeof(Pending) + it->second.data.size();
+        first = dirty.erase(first, last);
+    }
+    return ret;
+}
+
+int VFS::flush() {
+    return flush_dirty(true);
+}
+
+void VFS::flusher() {
+    std::unique_lock<std::mutex> l(flush_mtx);
+    while (!stop_flusher) {
+        flush_cv.wait_for(l, std::chrono::milliseconds(WB_TICK_MS));
+        if (stop_flusher)
+            break;
+        l.unlock();
+        flush_dirty(false);
+        l.lock();
+    }
+}
+
+void VFS::set_write_back(bool enable) {
+    if (enable == write_back)
+        return;
+    if (enable) {
+        lock_guard<recursive_mutex> l(mtx);
+        write_back = true;
+        stop_flusher = false;
+        flush_thread = std::thread(&VFS::flusher, this);
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> l(flush_mtx);
+        stop_flusher = true;
+    }
+    flush_cv.notify_one();
+    flush_thread.join();
+    lock_guard<recursive_mutex> l(mtx);
+    flush_dirty(true);
+    write_back = false;
+}
+
+void VFS::set_direct_io(bool enable, size_t cache_bytes) {
+    lock_guard<recursive_mutex> l(mtx);
+    direct_io = enable;
+    cache.set_capacity(enable ? cache_bytes : 0);
+}
+
+void VFS::batch(std::vector<Op> *ops) {
+    lock_guard<recursive_mutex> l(mtx);
+    for (auto &op : *ops) {
+        switch (op.type) {
+        case OpType::GET:
+            op.ret = get(op.doc.id, op.doc.data);
+            break;
+        case OpType::EXISTS:
+            op.ret = exists(op.doc.id) ? 0 : -1;
+            break;
+        case OpType::INSERT:
+            op.ret = mutate(op.doc.id, Opp::INSERT, op.doc.data);
+            break;
+        case OpType::UPDATE:
+            op.ret = mutate(op.doc.id, Opp::UPDATE, op.doc.data);
+            break;
+        case OpType::REMOVE:
+            op.ret = mutate(op.doc.id, Opp::DELETE, empty);
+            break;
+        }
+    }
+}
+
+// Records with first <= ID <= last as of now, buffered changes included
+int VFS::copy_range(ID first, ID last, std::vector<Record> *recs) const {
+    lock_guard<recursive_mutex> l(mtx);
+    std::vector<Record> file;
+    auto it = space.upper_bound(first);
+    if (it != space.begin())
+        --it;  // the file holding first, if any
+    for (; it != space.end() && it->first <= last; ++it) {
+        file.clear();
+        if (load_file(it->first, &file) != 0)
+            return -1;
+        for (auto &rec : file)
+            if (rec.id >= first && rec.id <= last)
+                recs->push_back(std::move(rec));
+    }
+    merge_pending(recs, dirty.lower_bound(first), dirty.upper_bound(last));
+    return 0;
+}
+
+// Fuzzy snapshot that doesn't block the engine for a full copy: only the
+// file boundaries are taken together with *seq, then the ID ranges between
+// them are copied one at a time, each under the lock. Later ranges may
+// already hold changes logged after *seq; replaying the log from *seq
+// (upserts and removes) on top of it converges to the same state.
+int VFS::snapshot(std::ostream &out, uint64_t *seq) {
+    std::vector<ID> bounds;
+    {
+        lock_guard<recursive_mutex> l(mtx);
+        *seq = log.head();
+        for (auto &it : space)
+            bounds.push_back(it.first);
+    }
+    std::vector<Record> recs;
+    std::string image;
+    for (size_t i = 0; i <= bounds.size(); i++) {
+        ID first = i ? bounds[i - 1] : std::numeric_limits<ID>::min();
+        if (i < bounds.size() && bounds[i] == first)
+            continue;  // nothing below the first file
+        ID last = i < bounds.size() ? bounds[i] - 1 :
+                                      std::numeric_limits<ID>::max();
+        recs.clear();
+        if (copy_range(first, last, &recs) != 0)
+            return -1;
+        for (size_t begin = 0; begin < recs.size(); begin += NFILES) {
+            int n = std::min<size_t>(NFILES, recs.size() - begin);
+            pack_file(&recs[begin], n, false, &image);
+            if (!write_document(out, {recs[begin].id, image}))
+                return -1;
+        }
+    }
+    out.flush();
+    return out ? 0 : -1;
+}
+
+int VFS::restore(std::istream &in) {
+    lock_guard<recursive_mutex> l(mtx);
+    std::vector<std::string> files;
+    fs::get_files(path, &files);
+    for (auto &file : files)
+        if (check_format(file) && fs::remove_file(path + "/" + file) != 0)
+            return -1;
+    space.clear();
+    dirty.clear();
+    dirty_bytes = 0;
+    cache.clear();
+    log.reset();
+    clear_indexes();
+    Document doc;
+    int ret;
+    while ((ret = read_document(in, &doc)) > 0) {
+        if (doc.id < 0 ||
+            fs::write_file(get_fullpath(doc.id, path), doc.data.data(),
+                           doc.data.size(), 0, true, false, direct_io) != 0 ||
+            open_file(doc.id) != 0)  // snapshots may hold legacy files
+            return -1;
+    }
+    if (ret < 0)
+        return -1;
+    for (auto &it : space)
+        if (fs::sync_file(get_fullpath(it.first, path)) != 0)
+            return -1;
+    if (fs::sync_file(path) != 0)
+        return -1;
+    return rebuild_indexes();
+}
+
+int VFS::create_index(const std::string &name, Extractor extract) {
+    lock_guard<recursive_mutex> l(mtx);
+    if (name.empty() || indexes.count(name))
+        return -1;
+    for (char c : name)
+        if (!isalnum(static_cast<unsigned char>(c)) && c != '_' && c != '-')
+            return -1;
+    std::unique_ptr<SecondaryIndex> idx(
+        new SecondaryIndex(path, name, std::move(extract)));
+    SecondaryIndex::Touched touched;
+    int ret = stored_indexes.erase(name) ? idx->open(&touched) : 1;
+    if (ret < 0)
+        return -1;
+    if (ret == 1 && (build_indexes({idx.get()}) != 0 || idx->save() != 0))
+        return -1;
+    if (!touched.empty()) {  // the journal may be ahead of the data
+        std::string data;
+        for (auto &it : touched)
+            idx->reconcile(it.first, it.second,
+                           get(it.first, data) == 0 ? &data : nullptr);
+        if (idx->save() != 0)
+            return -1;
+    }
+    indexes.emplace(name, std::move(idx));
+    return 0;
+}
+
+int VFS::drop_index(const std::string &name) {
+    lock_guard<recursive_mutex> l(mtx);
+    auto it = indexes.find(name);
+    if (it == indexes.end())
+        return -1;
+    it->second->drop();
+    indexes.erase(it);
+    return 0;
+}
+
+int VFS::find_by(const std::string &index, const std::string &from,
+                 const std::string &to, bool exact,
+                 std::vector<ID> *ids) const {
+    lock_guard<recursive_mutex> l(mtx);
+    auto it = indexes.find(index);
+    if (it == indexes.end())
+        return -1;
+    return it->second->find(from, to, exact, ids);
+}
+
+// Add all documents to the given (empty) indexes with a single scan
+int VFS::build_indexes(const std::vector<SecondaryIndex*> &idxs) {
+    if (flush_dirty(true) != 0)
+        return -1;
+    std::vector<Record> recs;
+    std::string data;
+    for (auto &it : space) {
+        recs.clear();
+        if (load_file(it.first, &recs) != 0)
+            return -1;
+        for (auto &rec : recs) {
+            if (decode_record(rec.data.data(), rec.data.size(), rec.flags,
+                              &data) != 0)
+                return -1;
+            for (auto idx : idxs)
+                if (idx->add(rec.id, data) != 0)
+                    return -1;
+        }
+    }
+    return 0;
+}
+
+// After changes that bypass mutate() (bulk load, restore)
+int VFS::rebuild_indexes() {
+    std::vector<SecondaryIndex*> idxs;
+    for (auto &it : indexes) {
+        it.second->drop();
+        idxs.push_back(it.second.get());
+    }
+    if (idxs.empty())
+        return 0;
+    if (build_indexes(idxs) != 0)
+        return -1;
+    for (auto idx : idxs)
+        if (idx->save() != 0)
+            return -1;
+    return 0;
+}
+
+void VFS::index_change(ID id, const std::string *old,
+                       const std::string *now) {
+    for (auto &it : indexes)
+        if (it.second->update(id, old, now, !write_back) != 0)
+            std::cerr << "Critical error: can't update index " << it.first
+                      << "\n";
+}
+
+// Merge the index deltas that are due into their sorted files. That drops
+// the journal, so the data it describes is flushed first.
+void VFS::merge_indexes() {
+    for (auto &it : indexes) {
+        if (!it.second->merge_due())
+            continue;
+        if (flush_dirty(true) != 0 || it.second->save() != 0)
+            std::cerr << "Critical error: can't merge index " << it.first
+                      << "\n";
+    }
+}
+
+// Data is about to be replaced and the indexes rebuilt, don't leave the
+// stored ones behind if that is interrupted
+void VFS::clear_indexes() {
+    drop_stored_indexes();
+    for (auto &it : indexes)
+        it.second->drop();
+}
+
+// Data is about to change without the stored indexes, they'd be stale
+void VFS::drop_stored_indexes() {
+    for (auto &name : stored_indexes) {
+        fs::remove_file(path + "/" + name + INDEX_EXT);
+        fs::remove_file(path + "/" + name + JOURNAL_EXT);
+    }
+    stored_indexes.clear();
+}
+
 void VFS::recover() {
     std::vector<std::string> files;
     fs::touch_dir(path);
     fs::get_files(path, &files);
+    auto has_ext = [](const std::string &file, const char *ext) {
+        size_t len = strlen(ext);
+        return file.size() > len &&
+               file.compare(file.size() - len, len, ext) == 0;
+    };
     for (auto file : files)
         if (check_format(file)) {
             std::cout << file << std::endl;
             recover_file(file);
+        } else if (has_ext(file, INDEX_EXT)) {
+            stored_indexes.insert(file.substr(0, file.size() -
+                                                 strlen(INDEX_EXT)));
+        } else if (has_ext(file, TMP_EXT)) {  // interrupted rewrite
+            fs::remove_file(path + "/" + file);
         }
+    trim_files();
+}
+
+// apply_pending writes files split off a file before rewriting it, after
+// a crash in between the original still holds the records of the new
+// files: keep only its entries below the next file.
+void VFS::trim_files() {
+    lock_guard<recursive_mutex> l(mtx);
+    for (auto it = space.begin(); it != space.end(); ++it) {
+        auto next = std::next(it);
+        if (next == space.end())
+            break;
+        std::string fullpath = get_fullpath(it->first, path);
+        FileHeader hdr;
+        if (read_header(fullpath, &hdr) != 0)
+            continue;
+        int n = 0;
+        while (n < NFILES && hdr.header[n].offset != 0 &&
+               hdr.header[n].id < next->first)
+            n++;
+        if (n == it->second)
+            continue;
+        std::cout << "trimming " << fullpath << " to " << n << std::endl;
+        for (int i = n; i < NFILES; i++)
+            hdr.header[i].offset = 0;
+        if (write_header(fullpath, &hdr) == 0)
+            it->second = n;
+    }
 }
 
 void VFS::recover_file(const std::string &file) {
     std::string fullpath = path + "/" + file;
     ID id = stoll(file);
     std::cout << fullpath << " " << id << std::endl;
-    int nrecords = 0;
-    FileHeader hdr;
     lock_guard<recursive_mutex> l(mtx);
-    if (read_header(fullpath, &hdr) == 0) {
+    if (open_file(id) == 0) {
         std::cout << "processing " << file << std::endl;
-        for (int i = 0; i < NFILES; i++) {
-            if (hdr.header[i].offset == 0)
-                break;
-            nrecords++;
-        }
-        space[id] = nrecords;
     } else {  // to delete corrupted file or rename (.db -> .bad)
         std::cout << "can't recover " << file << " (skip)" << std::endl;
     }
 }
 
+// Add an existing file to space, migrating a legacy one first
+int VFS::open_file(ID id) {
+    std::string fullpath = get_fullpath(id, path);
+    FileHeader hdr;
+    int ret = read_header(fullpath, &hdr, direct_io);
+    if (ret == 1) {
+        ret = migrate_file(id);
+        if (ret == 1)
+            return 0;  // had no records, removed
+        if (ret == 0)
+            ret = read_header(fullpath, &hdr, direct_io);
+    }
+    if (ret != 0)
+        return -1;
+    int nrecords = 0;
+    while (nrecords < NFILES && hdr.header[nrecords].offset != 0)
+        nrecords++;
+    space[id] = nrecords;
+    return 0;
+}
+
+// Rewrite a legacy file in the current format (tmp + rename, so a crash
+// leaves either version), returns 1 if it had no records and was removed
+int VFS::migrate_file(ID id) {
+    std::string fullpath = get_fullpath(id, path);
+    int64_t size = fs::file_size(fullpath);
+    if (size < static_cast<int64_t>(sizeof(LegacyHeader)))
+        return -1;
+    std::vector<char> cbuf(size);
+    if (fs::read_file(fullpath, cbuf.data(), size, 0, direct_io) != 0)
+        return -1;
+    LegacyHeader hdr;
+    memcpy(&hdr, cbuf.data(), sizeof(LegacyHeader));
+    std::vector<Record> recs;
+    for (int i = 0; i < NFILES && hdr.header[i].offset != 0; i++) {
+        const DiskEntry &e = hdr.header[i];
+        if (e.offset < sizeof(LegacyHeader) ||
+            e.offset > static_cast<size_t>(size) || e.size > size - e.offset) {
+            std::cerr << "Critical error: corrupted legacy file " << fullpath
+                      << "\n";
+            return -1;
+        }
+        recs.push_back({e.id, std::string(cbuf.data() + e.offset, e.size),
+                        0});
+    }
+    std::cout << "migrating " << fullpath << std::endl;
+    if (recs.empty())
+        return fs::remove_file(fullpath) == 0 ? 1 : -1;
+    if (write_packed(recs.data(), recs.size(), true, true) != 0 ||
+        fs::rename_file(fullpath + TMP_EXT, fullpath) != 0)
+        return -1;
+    return fs::sync_file(path);
+}
+
 #endif  // ENGINE_INCLUDE_VFS_H_
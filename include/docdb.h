@@ -24,7 +24,12 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE.
 */
 
+#include <cstdint>
+#include <functional>
+#include <istream>
+#include <ostream>
 #include <string>
+#include <vector>
 
 using ID = int64_t;
 
@@ -33,6 +38,53 @@ struct Document {
     std::string data;
 };
 
+// Bulk stream format: a sequence of (int64 id, uint64 size, data) records,
+// host byte order. Used by bulk_load/bulk_export and the docdb_bulk tool.
+inline bool write_document(std::ostream &out, const Document &doc) {
+    uint64_t size = doc.data.size();
+    out.write(reinterpret_cast<const char*>(&doc.id), sizeof(doc.id));
+    out.write(reinterpret_cast<const char*>(&size), sizeof(size));
+    out.write(doc.data.data(), size);
+    return static_cast<bool>(out);
+}
+
+// Returns 1 if a document was read, 0 on clean end of stream, -1 on error.
+inline int read_document(std::istream &in, Document *doc) {
+    uint64_t size;
+    if (!in.read(reinterpret_cast<char*>(&doc->id), sizeof(doc->id)))
+        return in.gcount() == 0 ? 0 : -1;
+    if (!in.read(reinterpret_cast<char*>(&size), sizeof(size)))
+        return -1;
+    doc->data.resize(size);
+    if (size && !in.read(&doc->data[0], size))
+        return -1;
+    return 1;
+}
+
+// A single operation of a batch, ret has the same meaning as the return
+// value of the corresponding call (exists: 0 if found, -1 otherwise).
+enum class OpType : uint8_t { GET, EXISTS, INSERT, UPDATE, REMOVE };
+
+struct Op {
+    OpType type;
+    Document doc;  // id for all ops, data for INSERT/UPDATE, result of GET
+    int ret;
+};
+
+struct LogRecord {
+    uint64_t seq;
+    Op op;  // INSERT, UPDATE or REMOVE as applied, ret unused
+};
+
+// Secondary index key of a document, returns false if it has none
+using Extractor = std::function<bool(const std::string &data,
+                                     std::string *key)>;
+
+// Extractor of a JSON object member by dot separated path ("address.city").
+// Strings are indexed unquoted, numbers and literals as written, so keys
+// compare as byte strings.
+Extractor json_field(const std::string &path);
+
 class DocumentDB {
  public:
     virtual bool exists(ID) const = 0;
@@ -40,6 +92,51 @@ class DocumentDB {
     virtual int remove(ID) = 0;
     virtual int update(ID, const std::string&) = 0;
     virtual int insert(const Document&) = 0;
+    // Load a (possibly unsorted) document stream, sorting externally in
+    // chunks of mem_limit (> 0) bytes. Existing IDs are overwritten.
+    virtual int bulk_load(std::istream&, size_t mem_limit) = 0;
+    // Write all documents in ID order using the bulk stream format.
+    virtual int bulk_export(std::ostream&) const = 0;
+    // Buffer mutations in memory and apply them per file in background.
+    // Disabling flushes everything buffered so far.
+    virtual void set_write_back(bool) = 0;
+    // Apply all buffered mutations now
+    virtual int flush() = 0;
+    // Bypass the page cache (O_DIRECT) and write block-aligned files,
+    // caching up to cache_bytes of records in the engine instead.
+    virtual void set_direct_io(bool, size_t cache_bytes) = 0;
+    // Store records of 64 bytes and more lz-compressed from now on,
+    // existing records are read either way
+    virtual void set_compression(bool) = 0;
+    // Run the ops in order under a single engine lock
+    virtual void batch(std::vector<Op>*) = 0;
+    // Replication: keep up to max_bytes of the mutation log (0 disables)
+    virtual void set_log_capacity(size_t max_bytes) = 0;
+    // Copy log records after seq `from`, up to max_bytes, waiting up to
+    // timeout_ms for new ones. Returns -1 if they are no longer kept.
+    virtual int read_log(uint64_t from, size_t max_bytes, int timeout_ms,
+                         std::vector<LogRecord>*, uint64_t *head) = 0;
+    // Seq of the last logged mutation
+    virtual uint64_t log_head() = 0;
+    // Write a copy of the data, fuzzy: *seq is the log head when it
+    // starts and later ranges may already hold changes made after it.
+    // Replay the log from *seq on top of it to get a consistent state.
+    virtual int snapshot(std::ostream&, uint64_t *seq) = 0;
+    // Replace all data by a snapshot
+    virtual int restore(std::istream&) = 0;
+    // Declare secondary index `name` ([A-Za-z0-9_-]+). Extractors aren't
+    // persisted: declare the same indexes after every start, before the
+    // first mutation, to reuse the stored ones; otherwise they are rebuilt
+    // by a full scan.
+    virtual int create_index(const std::string &name, Extractor) = 0;
+    virtual int drop_index(const std::string &name) = 0;
+    // IDs of documents whose key equals key, in ID order
+    virtual int find_by(const std::string &index, const std::string &key,
+                        std::vector<ID>*) const = 0;
+    // IDs of documents with from <= key < to (to empty: no upper bound),
+    // in key order
+    virtual int find_by(const std::string &index, const std::string &from,
+                        const std::string &to, std::vector<ID>*) const = 0;
 };
 
 DocumentDB& get_instance();
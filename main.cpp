@@ -22,7 +22,19 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE.
 */
 
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <sstream>
+#include <thread>
+#include <vector>
 #include "docdb.h"
 
 void test_simple(DocumentDB& db) {
@@ -86,9 +98,509 @@ void test_perf(DocumentDB& db) {
     std::cout << "test_perf 5/5: check Ok\n";
 }
 
+void test_bulk(DocumentDB& db) {
+    const int SIZE = 1000;
+    std::stringstream in, out;
+    Document doc;
+    for (int i = 0; i < SIZE; i++) {  // shuffled ids, some duplicated
+        doc.id = (i * 7919) % SIZE;
+        doc.data = "old " + std::to_string(doc.id);
+        write_document(in, doc);
+    }
+    for (int i = 0; i < SIZE; i += 3) {
+        doc.id = i;
+        doc.data = "new " + std::to_string(i);
+        write_document(in, doc);
+    }
+    std::stringstream copy(in.str());
+    assert(db.bulk_load(copy, 0) < 0);  // no memory for the sort
+    assert(db.exists(0) == false);
+    assert(db.bulk_load(in, 4096) == 0);  // force spills to run files
+    for (int i = 0; i < SIZE; i++) {
+        assert(db.get(i, &doc) == 0);
+        assert(doc.data == (i % 3 ? "old " : "new ") + std::to_string(i));
+    }
+    std::cout << "test_bulk 1/3: load Ok\n";
+    assert(db.bulk_export(out) == 0);
+    for (int i = 0; i < SIZE; i++) {
+        assert(read_document(out, &doc) == 1);
+        assert(doc.id == i);
+        assert(doc.data == (i % 3 ? "old " : "new ") + std::to_string(i));
+    }
+    assert(read_document(out, &doc) == 0);
+    std::cout << "test_bulk 2/3: export Ok\n";
+    in.clear();
+    in.str("");
+    for (int i = SIZE + 1; i >= 0; i -= 2) {  // into non-empty db
+        doc.id = i;
+        doc.data = "more";
+        write_document(in, doc);
+    }
+    assert(db.bulk_load(in, 1 << 20) == 0);
+    for (int i = 0; i <= SIZE + 1; i++) {
+        if (i == SIZE)  // even, never loaded
+            continue;
+        assert(db.get(i, &doc) == 0);
+        if (i % 2)
+            assert(doc.data == "more");
+        assert(db.remove(i) == 0);
+    }
+    std::cout << "test_bulk 3/3: load into non-empty db Ok\n";
+}
+
+void test_write_back(DocumentDB& db) {
+    const int SIZE = 1000;
+    Document doc;
+    db.set_write_back(true);
+    for (int i = SIZE - 1; i >= 0; i--) {  // reverse order, many splits
+        doc.id = i;
+        doc.data = "some data";
+        assert(db.insert(doc) == 0);
+    }
+    for (int n = 0; n < 10; n++)  // hot key
+        assert(db.update(42, "hot " + std::to_string(n)) == 0);
+    assert(db.get(42, &doc) == 0 && doc.data == "hot 9");
+    std::cout << "test_write_back 1/5: buffered insert/update Ok\n";
+    for (int i = 0; i < SIZE; i += 2)
+        assert(db.remove(i) == 0);
+    assert(db.remove(0) < 0);
+    assert(db.exists(0) == false && db.exists(1) == true);
+    assert(db.flush() == 0);
+    assert(db.exists(0) == false && db.exists(1) == true);
+    std::cout << "test_write_back 2/5: buffered remove/flush Ok\n";
+    for (int i = 1; i < SIZE; i += 2)
+        assert(db.update(i, "Some other data") == 0);
+    db.set_write_back(false);
+    for (int i = 0; i < SIZE; i++) {
+        assert(db.exists(i) == (i % 2 == 1));
+        if (i % 2)
+            assert(db.get(i, &doc) == 0 && doc.data == "Some other data");
+    }
+    std::cout << "test_write_back 3/5: persisted Ok\n";
+    for (int i = 1; i < SIZE; i += 2)
+        assert(db.remove(i) == 0);
+    for (int i = 0; i < SIZE; i++)
+        assert(db.exists(i) == false);
+    std::cout << "test_write_back 4/5: remove Ok\n";
+    std::stringstream none;
+    assert(db.restore(none) == 0);  // empty, the next file is named 7
+    db.set_write_back(true);
+    assert(db.insert({7, "aged"}) == 0);
+    // past WB_MAX_AGE_MS + WB_TICK_MS, the flusher writes it on its own
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    assert(std::ifstream("db/00000000000000000007.db").good());
+    db.set_write_back(false);
+    assert(db.remove(7) == 0);
+    std::cout << "test_write_back 5/5: background flush Ok\n";
+}
+
+void test_direct_io(DocumentDB& db) {
+    const int SIZE = 200;
+    Document doc;
+    db.set_direct_io(true, 64 << 10);
+    for (int i = 0; i < SIZE; i++) {
+        doc.id = (i * 7) % SIZE;
+        doc.data = std::string(doc.id * 37 % 5000, 'a' + doc.id % 26);
+        assert(db.insert(doc) == 0);
+    }
+    for (int n = 0; n < 2; n++)  // second pass is served from the cache
+        for (int i = 0; i < SIZE; i++) {
+            assert(db.get(i, &doc) == 0);
+            assert(doc.data == std::string(i * 37 % 5000, 'a' + i % 26));
+        }
+    std::cout << "test_direct_io 1/4: insert/get Ok\n";
+    for (int i = 0; i < SIZE; i += 2)
+        assert(db.update(i, "Some other data") == 0);
+    for (int i = 1; i < SIZE; i += 4)
+        assert(db.remove(i) == 0);
+    for (int i = 0; i < SIZE; i++) {
+        assert(db.exists(i) == (i % 4 != 1));
+        if (i % 2 == 0)
+            assert(db.get(i, &doc) == 0 && doc.data == "Some other data");
+    }
+    std::cout << "test_direct_io 2/4: update/remove Ok\n";
+    db.set_direct_io(false, 0);  // in-place changes of aligned files
+    for (int i = 1; i < SIZE; i += 4)
+        assert(db.insert({i, "back"}) == 0);
+    for (int i = 0; i < SIZE; i++) {
+        assert(db.get(i, &doc) == 0);
+        if (i % 4 == 1)
+            assert(doc.data == "back");
+        else if (i % 2)
+            assert(doc.data == std::string(i * 37 % 5000, 'a' + i % 26));
+    }
+    std::cout << "test_direct_io 3/4: buffered I/O on aligned files Ok\n";
+    db.set_direct_io(true, 0);
+    for (int i = 0; i < SIZE; i++)
+        assert(db.remove(i) == 0);
+    for (int i = 0; i < SIZE; i++)
+        assert(db.exists(i) == false);
+    db.set_direct_io(false, 0);
+    std::cout << "test_direct_io 4/4: remove Ok\n";
+}
+
+// File written before the header got a magic and version: 10 entries of
+// (offset, size, id) followed by the records, IDs from first on
+std::string legacy_file(ID first, const std::vector<std::string> &values) {
+    const int NENTRIES = 10;
+    struct { size_t offset, size; ID id; } entries[NENTRIES] = {};
+    std::string file(sizeof(entries), '\0');
+    for (size_t i = 0; i < values.size(); i++) {
+        entries[i] = {file.size(), values[i].size(),
+                      first + static_cast<ID>(i)};
+        file += values[i];
+    }
+    memcpy(&file[0], entries, sizeof(entries));
+    return file;
+}
+
+void test_legacy_format(DocumentDB& db) {
+    const char *values[] = {"abcdefghij-0", "abcdefghij-1", "abcdefghij-2"};
+    std::stringstream snap;
+    write_document(snap, {0, legacy_file(0, {values[0], values[1],
+                                             values[2]})});
+    assert(db.restore(snap) == 0);  // migrated to the current format
+    Document doc;
+    for (int i = 0; i < 3; i++)
+        assert(db.get(i, &doc) == 0 && doc.data == values[i]);
+    assert(db.insert({1, "changed"}) == 0);
+    assert(db.get(0, &doc) == 0 && doc.data == values[0]);
+    assert(db.get(1, &doc) == 0 && doc.data == "changed");
+    for (int i = 0; i < 3; i++)
+        assert(db.remove(i) == 0);
+    std::cout << "test_legacy_format 1/1: migrate Ok\n";
+}
+
+void test_batch(DocumentDB& db) {
+    std::vector<Op> ops = {
+        {OpType::INSERT, {1, "one"}, -1},
+        {OpType::INSERT, {3, ""}, -1},
+        {OpType::INSERT, {2, "two"}, -1},  // middle of a file, empty tail
+        {OpType::EXISTS, {2, ""}, -1},
+        {OpType::UPDATE, {1, "uno"}, -1},
+        {OpType::GET, {1, ""}, -1},
+        {OpType::REMOVE, {2, ""}, -1},
+        {OpType::GET, {2, ""}, 0},
+        {OpType::REMOVE, {4, ""}, 0},
+    };
+    db.batch(&ops);
+    for (int i = 0; i < 7; i++)
+        assert(ops[i].ret == 0);
+    assert(ops[5].doc.data == "uno");
+    assert(ops[7].ret < 0 && ops[8].ret < 0);
+    std::cout << "test_batch 1/2: batch Ok\n";
+    for (int i = 10; i < 40; i++)  // splits moving tails to new files
+        assert(db.insert({(i * 7) % 30 + 10, std::to_string(i)}) == 0);
+    for (int i = 10; i < 40; i++)
+        assert(db.exists(i) == true);
+    for (ID id : {1, 3})
+        assert(db.remove(id) == 0);
+    for (int i = 10; i < 40; i++)
+        assert(db.remove(i) == 0);
+    std::cout << "test_batch 2/2: insert with splits Ok\n";
+}
+
+void test_replication(DocumentDB& db) {
+    std::vector<LogRecord> recs;
+    uint64_t head, seq;
+    db.set_log_capacity(1 << 20);
+    uint64_t start = db.log_head();
+    assert(db.insert({5, "five"}) == 0);
+    assert(db.insert({6, "six"}) == 0);
+    assert(db.update(5, "FIVE") == 0);
+    assert(db.remove(6) == 0);
+    assert(db.remove(7) < 0);  // failed ops are not logged
+    assert(db.read_log(start, 1 << 20, 0, &recs, &head) == 0);
+    assert(recs.size() == 4 && head == start + 4);
+    assert(recs[2].seq == start + 3 && recs[2].op.type == OpType::UPDATE);
+    assert(recs[2].op.doc.id == 5 && recs[2].op.doc.data == "FIVE");
+    assert(recs[3].op.type == OpType::REMOVE && recs[3].op.doc.id == 6);
+    std::cout << "test_replication 1/4: log Ok\n";
+    std::stringstream snap;
+    assert(db.snapshot(snap, &seq) == 0 && seq == head);
+    assert(db.remove(5) == 0);
+    assert(db.restore(snap) == 0);
+    Document doc;
+    assert(db.get(5, &doc) == 0 && doc.data == "FIVE");
+    assert(db.exists(6) == false);
+    recs.clear();
+    assert(db.read_log(head, 1 << 20, 0, &recs, &head) < 0);  // resync
+    std::cout << "test_replication 2/4: snapshot/restore Ok\n";
+    db.set_log_capacity(0);
+    assert(db.remove(5) == 0);
+    assert(db.read_log(start, 1 << 20, 0, &recs, &head) < 0);
+    std::cout << "test_replication 3/4: log capacity Ok\n";
+    db.set_log_capacity(64 << 20);
+    std::atomic<bool> stop(false);
+    std::thread writer([&]() {  // races with the snapshot
+        for (int n = 0; !stop; n++) {
+            ID id = (n * 37) % 500;
+            if (n % 5 == 4)
+                db.remove(id);
+            else
+                db.update(id, "v" + std::to_string(n));
+        }
+    });
+    while (db.log_head() < start + 2000) {}
+    std::stringstream fuzzy, expected, replayed;
+    assert(db.snapshot(fuzzy, &seq) == 0);
+    stop = true;
+    writer.join();
+    assert(db.bulk_export(expected) == 0);
+    recs.clear();
+    assert(db.read_log(seq, 64 << 20, 0, &recs, &head) == 0);
+    assert(db.restore(fuzzy) == 0);
+    std::vector<Op> ops;
+    for (auto &rec : recs)
+        ops.push_back(rec.op);
+    db.batch(&ops);  // replay on top of the snapshot, as replicas do
+    assert(db.bulk_export(replayed) == 0);
+    assert(expected.str() == replayed.str());
+    for (int i = 0; i < 500; i++)
+        db.remove(i);
+    db.set_log_capacity(0);
+    std::cout << "test_replication 4/4: snapshot with concurrent writes Ok\n";
+}
+
+std::string make_json(int id) {
+    std::stringstream ss;
+    ss << "{\"id\": " << id << ", \"name\": \"user" << id
+       << "\", \"email\": \"user" << id << "@example.com\", \"orders\": [";
+    for (int i = 0; i < 8; i++)
+        ss << (i ? ", " : "") << "{\"sku\": \"item-" << (id + i) % 50
+           << "\", \"qty\": " << i + 1 << ", \"status\": \"shipped\"}";
+    ss << "]}";
+    return ss.str();
+}
+
+void test_compression(DocumentDB& db) {
+    const int SIZE = 100;
+    Document doc;
+    std::string noise;
+    for (int i = 0; i < 300; i++)
+        noise += static_cast<char>(rand() % 256);
+    db.set_compression(true);
+    for (int i = 0; i < SIZE; i++) {  // every other id first, then the rest
+        doc.id = (i * 2) % SIZE + (i * 2 >= SIZE);
+        doc.data = doc.id % 10 == 0 ? "tiny" :
+                   doc.id % 10 == 1 ? noise : make_json(doc.id);
+        assert(db.insert(doc) == 0);
+    }
+    for (int i = 0; i < SIZE; i++) {
+        assert(db.get(i, &doc) == 0);
+        assert(doc.data == (i % 10 == 0 ? "tiny" :
+                            i % 10 == 1 ? noise : make_json(i)));
+    }
+    std::cout << "test_compression 1/4: insert/get Ok\n";
+    std::stringstream packed, plain;
+    uint64_t seq;
+    assert(db.snapshot(packed, &seq) == 0);
+    for (int i = 0; i < SIZE; i += 3)
+        assert(db.update(i, make_json(i * 1000)) == 0);
+    for (int i = 1; i < SIZE; i += 4)
+        assert(db.remove(i) == 0);
+    for (int i = 0; i < SIZE; i++) {
+        assert(db.exists(i) == (i % 4 != 1));
+        if (i % 3 == 0 && i % 4 != 1)
+            assert(db.get(i, &doc) == 0 && doc.data == make_json(i * 1000));
+    }
+    std::cout << "test_compression 2/4: update/remove Ok\n";
+    db.set_compression(false);  // mixed files are still readable
+    for (int i = 1; i < SIZE; i += 4)
+        assert(db.insert({i, make_json(i)}) == 0);
+    for (int i = 0; i < SIZE; i++) {
+        assert(db.get(i, &doc) == 0);
+        if (i % 3 == 0 && i % 4 != 1)
+            assert(doc.data == make_json(i * 1000));
+        else if (i % 4 == 1 || i % 10 > 1)
+            assert(doc.data == make_json(i));
+    }
+    std::cout << "test_compression 3/4: plain and compressed records Ok\n";
+    assert(db.restore(packed) == 0);
+    for (int i = 0; i < SIZE; i++)
+        if (i % 10 > 1)
+            assert(db.update(i, make_json(i)) == 0);  // stored as is now
+    assert(db.snapshot(plain, &seq) == 0);
+    assert(packed.str().size() < plain.str().size() * 2 / 3);
+    for (int i = 0; i < SIZE; i++)
+        assert(db.remove(i) == 0);
+    std::cout << "test_compression 4/4: size Ok\n";
+}
+
+std::string make_person(int id, const std::string &city) {
+    std::stringstream ss;
+    ss << "{\"name\": \"p" << id << "\", \"tags\": [1, {\"city\": \"x\"}], "
+       << "\"address\": {\"zip\": " << 10000 + id % 7
+       << ", \"city\": \"" << city << "\"}}";
+    return ss.str();
+}
+
+void test_indexes(DocumentDB& db) {
+    const char *cities[] = {"Berlin", "Moscow", "Paris", "Rome"};
+    std::vector<ID> ids;
+    assert(db.create_index("city", json_field("address.city")) == 0);
+    assert(db.create_index("city", json_field("name")) < 0);
+    assert(db.create_index("bad/name", json_field("name")) < 0);
+    for (int i = 0; i < 40; i++)
+        assert(db.insert({i, make_person(i, cities[i % 4])}) == 0);
+    assert(db.insert({40, "not json"}) == 0);
+    assert(db.find_by("city", "Paris", &ids) == 0 && ids.size() == 10);
+    for (size_t i = 0; i < ids.size(); i++)
+        assert(ids[i] == static_cast<ID>(4 * i + 2));
+    ids.clear();
+    assert(db.find_by("city", "M", "Q", &ids) == 0 && ids.size() == 20);
+    assert(ids[0] == 1 && ids[10] == 2);  // key order, then ID order
+    ids.clear();
+    assert(db.find_by("zip", "10000", &ids) < 0);
+    // escaped member name and value, with a surrogate pair
+    assert(db.insert({41, "{\"addr\\u0065ss\": {\"city\": "
+                          "\"Caf\\u00E9 \\ud83c\\udf70\"}}"}) == 0);
+    ids.clear();
+    assert(db.find_by("city", "Caf\xc3\xa9 \xf0\x9f\x8d\xb0", &ids) == 0);
+    assert(ids.size() == 1 && ids[0] == 41);
+    assert(db.insert({42, "{\"address\": {\"city\": \"\\udf70\"}}"}) == 0);
+    ids.clear();
+    assert(db.find_by("city", "", "", &ids) == 0 && ids.size() == 41);
+    std::cout << "test_indexes 1/5: find_by Ok\n";
+    for (int i = 0; i < 40; i += 4)
+        assert(db.update(i, make_person(i, "Paris")) == 0);
+    for (int i = 2; i < 40; i += 8)
+        assert(db.remove(i) == 0);
+    ids.clear();
+    assert(db.find_by("city", "Paris", &ids) == 0 && ids.size() == 15);
+    ids.clear();
+    assert(db.find_by("city", "Berlin", &ids) == 0 && ids.empty());
+    std::cout << "test_indexes 2/5: update/remove Ok\n";
+    assert(db.create_index("zip", json_field("address.zip")) == 0);  // scan
+    ids.clear();
+    assert(db.find_by("zip", "10003", &ids) == 0 && ids.size() == 5);
+    db.set_write_back(true);
+    assert(db.update(1, make_person(1, "Rome")) == 0);
+    assert(db.remove(17) == 0);
+    ids.clear();
+    assert(db.find_by("city", "Rome", &ids) == 0 && ids.size() == 11);
+    ids.clear();
+    assert(db.find_by("zip", "10003", &ids) == 0 && ids.size() == 4);
+    db.set_write_back(false);
+    std::stringstream bulk;
+    write_document(bulk, {100, make_person(100, "Rome")});
+    assert(db.bulk_load(bulk, 1 << 20) == 0);  // indexes are rebuilt
+    ids.clear();
+    assert(db.find_by("city", "Rome", "", &ids) == 0 && ids.size() == 12);
+    assert(ids.back() == 100);
+    std::stringstream bad;  // rejected before any change
+    write_document(bad, {101, make_person(101, "Rome")});
+    write_document(bad, {-5, make_person(5, "Rome")});
+    assert(db.bulk_load(bad, 1 << 20) < 0);
+    ids.clear();
+    assert(db.find_by("city", "Rome", &ids) == 0 && ids.size() == 12);
+    std::cout << "test_indexes 3/5: build, write-back and bulk load Ok\n";
+    // enough long keys for several merges into the sorted file
+    const int n = 20000;
+    std::string pad(80, 'x');
+    db.set_write_back(true);
+    for (int i = 0; i < n; i++) {
+        std::string key = std::to_string(n - i);
+        key = "long-" + std::string(6 - key.size(), '0') + key + pad;
+        assert(db.insert({1000 + i, make_person(i, key)}) == 0);
+    }
+    for (int i = 0; i < n; i += 2)
+        assert(db.update(1000 + i, make_person(i, "Paris")) == 0);
+    db.set_write_back(false);
+    ids.clear();
+    assert(db.find_by("city", "long-", "long.", &ids) == 0);
+    assert(static_cast<int>(ids.size()) == n / 2);
+    for (size_t i = 0; i < ids.size(); i++)  // key order, the reverse
+        assert(ids[i] == 1000 + n - 1 - 2 * static_cast<ID>(i));
+    ids.clear();
+    assert(db.find_by("city", "Paris", &ids) == 0);
+    assert(static_cast<int>(ids.size()) == 15 + n / 2);
+    for (int i = 0; i < n; i++)
+        assert(db.remove(1000 + i) == 0);
+    ids.clear();
+    assert(db.find_by("city", "Paris", &ids) == 0 && ids.size() == 15);
+    std::cout << "test_indexes 4/5: merge into the sorted file Ok\n";
+    assert(db.drop_index("zip") == 0 && db.drop_index("zip") < 0);
+    for (int i = 0; i <= 100; i++)
+        db.remove(i);
+    ids.clear();
+    assert(db.find_by("city", "", "", &ids) == 0 && ids.empty());
+    assert(db.drop_index("city") == 0);
+    std::cout << "test_indexes 5/5: drop Ok\n";
+}
+
+// What a crash leaves behind, written before the engine starts: the .tmp
+// file of an interrupted rewrite, file 0 still holding records 2 and 3
+// that were already split off into file 2, and an index journal ahead of
+// the data (changes to 0 and 1 never applied) with a torn tail
+void make_crashed_db() {
+    mkdir("db", 0750);
+    DIR *dir = opendir("db");
+    assert(dir);
+    while (struct dirent *entry = readdir(dir))
+        if (entry->d_name[0] != '.')
+            unlink((std::string("db/") + entry->d_name).c_str());
+    closedir(dir);
+    std::ofstream("db/00000000000000000000.db", std::ios::binary)
+        << legacy_file(0, {"{\"city\": \"c0\"}", "{\"city\": \"c1\"}",
+                           "{\"city\": \"old\"}", "{\"city\": \"old\"}"});
+    std::ofstream("db/00000000000000000002.db", std::ios::binary)
+        << legacy_file(2, {"{\"city\": \"n2\"}", "{\"city\": \"n3\"}"});
+    std::ofstream("db/00000000000000000004.db.tmp") << "partial";
+    std::ofstream idx("db/city.idx", std::ios::binary);
+    const char *keys[] = {"c0", "c1", "n2", "n3"};
+    for (int i = 0; i < 4; i++)
+        write_document(idx, {i, keys[i]});
+    std::ofstream journal("db/city.log", std::ios::binary);
+    write_document(journal, {1, "-c1"});
+    write_document(journal, {1, "+ghost"});
+    write_document(journal, {0, "-c0"});
+    journal << "torn";
+}
+
+void test_recovery(DocumentDB& db) {
+    const char *values[] = {"{\"city\": \"c0\"}", "{\"city\": \"c1\"}",
+                            "{\"city\": \"n2\"}", "{\"city\": \"n3\"}"};
+    std::stringstream out;
+    Document doc;
+    assert(db.bulk_export(out) == 0);
+    for (int i = 0; i < 4; i++) {
+        assert(read_document(out, &doc) == 1);
+        assert(doc.id == i && doc.data == values[i]);
+    }
+    assert(read_document(out, &doc) == 0);
+    assert(!std::ifstream("db/00000000000000000004.db.tmp").good());
+    std::cout << "test_recovery 1/2: trim split file, remove tmp Ok\n";
+    std::vector<ID> ids;
+    assert(db.create_index("city", json_field("city")) == 0);
+    assert(db.find_by("city", "ghost", &ids) == 0 && ids.empty());
+    assert(db.find_by("city", "c0", &ids) == 0 && ids.size() == 1);
+    assert(db.find_by("city", "c1", &ids) == 0 && ids.size() == 2);
+    assert(ids[0] == 0 && ids[1] == 1);
+    ids.clear();
+    assert(db.find_by("city", "", "", &ids) == 0 && ids.size() == 4);
+    assert(db.update(1, "{\"city\": \"c9\"}") == 0);  // journal usable
+    ids.clear();
+    assert(db.find_by("city", "c9", &ids) == 0 && ids.size() == 1);
+    for (int i = 0; i < 4; i++)
+        assert(db.remove(i) == 0);
+    assert(db.drop_index("city") == 0);
+    std::cout << "test_recovery 2/2: reconcile index journal Ok\n";
+}
+
 int main(int argc, char *argv[]) {
+    make_crashed_db();
     DocumentDB& db = get_instance();
+    test_recovery(db);
     test_simple(db);
     test_perf(db);
+    test_bulk(db);
+    test_write_back(db);
+    test_direct_io(db);
+    test_legacy_format(db);
+    test_batch(db);
+    test_replication(db);
+    test_compression(db);
+    test_indexes(db);
     return 0;
 }
@@ -0,0 +1,273 @@
+/*
+MIT License
+
+Copyright (c) 2019 Konstantin Belyavskiy
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "docdb.h"
+#include "protocol.h"
+
+// docdb_bench: pipelined load generator for docdb_server. Each connection
+// owns a disjoint key range, so every GET result can be verified against
+// the last value written by the same connection.
+
+struct Config {
+    std::string tcp_addr, unix_path;
+    int conns = 4;
+    int64_t frames = 10000;  // per connection
+    int depth = 8;  // frames in flight per connection
+    int batch = 16;  // ops per frame
+    int reads = 50;  // percent of GETs
+    int64_t keys = 10000;  // total
+    size_t value_size = 100;
+    ID base = 0;  // first key
+    bool stats = false;  // only print server stats
+};
+
+std::atomic<int64_t> total_ops(0), errors(0);
+
+int connect_to(const Config &cfg) {
+    for (int attempt = 0; attempt < 50; attempt++) {  // server may start late
+        int fd = -1;
+        if (!cfg.unix_path.empty()) {
+            struct sockaddr_un sa = {};
+            sa.sun_family = AF_UNIX;
+            strncpy(sa.sun_path, cfg.unix_path.c_str(),
+                    sizeof(sa.sun_path) - 1);
+            fd = socket(AF_UNIX, SOCK_STREAM, 0);
+            if (fd != -1 && connect(fd, reinterpret_cast<sockaddr*>(&sa),
+                                    sizeof(sa)) == 0)
+                return fd;
+        } else {
+            size_t colon = cfg.tcp_addr.rfind(':');
+            struct addrinfo hints = {}, *res;
+            hints.ai_socktype = SOCK_STREAM;
+            if (colon != std::string::npos &&
+                getaddrinfo(cfg.tcp_addr.substr(0, colon).c_str(),
+                            cfg.tcp_addr.substr(colon + 1).c_str(), &hints,
+                            &res) == 0) {
+                fd = socket(res->ai_family, res->ai_socktype,
+                            res->ai_protocol);
+                int ok = fd != -1 &&
+                         connect(fd, res->ai_addr, res->ai_addrlen) == 0;
+                freeaddrinfo(res);
+                if (ok) {
+                    int one = 1;
+                    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one,
+                               sizeof(one));
+                    return fd;
+                }
+            }
+        }
+        if (fd != -1)
+            close(fd);
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    perror("connect");
+    return -1;
+}
+
+bool write_all(int fd, const std::string &buf) {
+    size_t done = 0;
+    while (done < buf.size()) {
+        ssize_t n = write(fd, buf.data() + done, buf.size() - done);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        done += n;
+    }
+    return true;
+}
+
+// Read one response frame into ops (sized as the matching request)
+bool read_response(int fd, std::string *in, std::vector<Op> *ops) {
+    int64_t len;
+    while ((len = proto::frame_ready(*in, 0)) == 0) {
+        char chunk[64 << 10];
+        ssize_t n = read(fd, chunk, sizeof(chunk));
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        in->append(chunk, n);
+    }
+    if (len < 0 || proto::decode_response(in->data() + sizeof(uint32_t), len,
+                                          ops) != 0)
+        return false;
+    in->erase(0, sizeof(uint32_t) + len);
+    return true;
+}
+
+uint64_t next_rand(uint64_t *state) {  // xorshift64
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+std::string make_value(ID id, int64_t version, size_t size) {
+    std::string v = std::to_string(id) + ":" + std::to_string(version) + ":";
+    if (v.size() < size)
+        v.resize(size, 'x');
+    return v;
+}
+
+void run_conn(const Config &cfg, int n) {
+    int fd = connect_to(cfg);
+    if (fd == -1) {
+        errors++;
+        return;
+    }
+    int64_t nkeys = std::max<int64_t>(1, cfg.keys / cfg.conns);
+    ID first = cfg.base + n * nkeys;
+    std::vector<int64_t> version(nkeys, -1);  // -1: not written yet
+    std::deque<std::vector<Op>> inflight;  // expected results
+    std::string in, out;
+    uint64_t rnd = 0x9e3779b97f4a7c15ULL * (n + 1);
+    int64_t sent = 0, done = 0, ops = 0;
+    while (done < cfg.frames) {
+        out.clear();
+        while (sent < cfg.frames &&
+               static_cast<int>(inflight.size()) < cfg.depth) {
+            std::vector<Op> frame(cfg.batch);
+            for (auto &op : frame) {
+                int64_t k = next_rand(&rnd) % nkeys;
+                op.doc.id = first + k;
+                if (static_cast<int>(next_rand(&rnd) % 100) < cfg.reads) {
+                    op.type = OpType::GET;
+                    op.ret = version[k] < 0 ? -1 : 0;
+                    if (version[k] >= 0)
+                        op.doc.data = make_value(op.doc.id, version[k],
+                                                 cfg.value_size);
+                } else {
+                    op.type = OpType::UPDATE;
+                    op.ret = 0;
+                    op.doc.data = make_value(op.doc.id, ++version[k],
+                                             cfg.value_size);
+                }
+            }
+            proto::encode_request(frame, &out);
+            for (auto &op : frame)  // keep only what GET should return
+                if (op.type != OpType::GET)
+                    op.doc.data.clear();
+            inflight.push_back(std::move(frame));
+            sent++;
+        }
+        if (!out.empty() && !write_all(fd, out))
+            break;
+        std::vector<Op> expected = std::move(inflight.front());
+        inflight.pop_front();
+        std::vector<Op> got(expected.size());
+        if (!read_response(fd, &in, &got))
+            break;
+        for (size_t i = 0; i < got.size(); i++)
+            if (got[i].ret != expected[i].ret ||
+                got[i].doc.data != expected[i].doc.data)
+                errors++;
+        ops += got.size();
+        done++;
+    }
+    if (done < cfg.frames) {
+        std::cerr << "connection " << n << " failed after " << done
+                  << " frames\n";
+        errors++;
+    }
+    total_ops += ops;
+    close(fd);
+}
+
+int print_stats(const Config &cfg) {
+    int fd = connect_to(cfg);
+    std::vector<Op> ops = {{proto::STATS, {0, ""}, 0}};
+    std::string out, in;
+    proto::encode_request(ops, &out);
+    if (fd == -1 || !write_all(fd, out) || !read_response(fd, &in, &ops))
+        return 1;
+    std::cout << ops[0].doc.data << std::endl;
+    close(fd);
+    return 0;
+}
+
+int usage() {
+    std::cerr << "usage: docdb_bench (-t host:port | -u path) [-c conns] "
+              << "[-f frames] [-d depth] [-b batch] [-r read%] [-k keys] "
+              << "[-s value_size] [-o first_key] [-S]\n"
+              << "  -S  print server stats and exit\n";
+    return 1;
+}
+
+int main(int argc, char *argv[]) {
+    Config cfg;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:u:c:f:d:b:r:k:s:o:S")) != -1) {
+        switch (opt) {
+        case 't': cfg.tcp_addr = optarg; break;
+        case 'u': cfg.unix_path = optarg; break;
+        case 'c': cfg.conns = atoi(optarg); break;
+        case 'f': cfg.frames = atoll(optarg); break;
+        case 'd': cfg.depth = atoi(optarg); break;
+        case 'b': cfg.batch = atoi(optarg); break;
+        case 'r': cfg.reads = atoi(optarg); break;
+        case 'k': cfg.keys = atoll(optarg); break;
+        case 's': cfg.value_size = atoll(optarg); break;
+        case 'o': cfg.base = atoll(optarg); break;
+        case 'S': cfg.stats = true; break;
+        default: return usage();
+        }
+    }
+    if (cfg.tcp_addr.empty() == cfg.unix_path.empty() || cfg.conns < 1 ||
+        cfg.depth < 1 || cfg.batch < 1 ||
+        cfg.batch > static_cast<int>(proto::MAX_OPS))
+        return usage();
+    if (cfg.stats)
+        return print_stats(cfg);
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (int i = 0; i < cfg.conns; i++)
+        threads.emplace_back(run_conn, std::cref(cfg), i);
+    for (auto &t : threads)
+        t.join();
+    double sec = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+    std::cout << total_ops << " ops in " << sec << " s, "
+              << static_cast<int64_t>(total_ops / sec) << " ops/s, "
+              << errors << " errors" << std::endl;
+    return errors ? 1 : 0;
+}
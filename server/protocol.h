@@ -0,0 +1,161 @@
+#ifndef SERVER_PROTOCOL_H_
+#define SERVER_PROTOCOL_H_
+/*
+MIT License
+
+Copyright (c) 2019 Konstantin Belyavskiy
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "docdb.h"
+
+// Binary protocol, host byte order, every frame is length prefixed:
+//   frame    := u32 body_len, body
+//   request  := u16 nops, nops * (u8 type, i64 id, u32 len, data[len])
+//   response := u16 nops, nops * (i32 ret, u32 len, data[len])
+// A request frame is executed as one DocumentDB::batch() call and gets
+// exactly one response frame. Clients may pipeline any number of frames,
+// responses come back in the same order on the same connection.
+// A frame holding a single STATS op returns server/replication stats as
+// text; replicas answer writes with ret -2.
+
+namespace proto {
+
+const uint32_t MAX_FRAME = 64 << 20;
+const size_t MAX_OPS = 0xffff;
+const OpType STATS = static_cast<OpType>(0x80);  // server level op
+
+class Reader {
+ public:
+    Reader(const char *p, size_t size): p(p), end(p + size) {}
+    template <typename T> bool get(T *v) {
+        if (static_cast<size_t>(end - p) < sizeof(T))
+            return false;
+        memcpy(v, p, sizeof(T));
+        p += sizeof(T);
+        return true;
+    }
+    bool get_bytes(std::string *s) {
+        uint32_t len;
+        if (!get(&len) || static_cast<size_t>(end - p) < len)
+            return false;
+        s->assign(p, len);
+        p += len;
+        return true;
+    }
+    bool done() const { return p == end; }
+ private:
+    const char *p, *end;
+};
+
+template <typename T> void put(std::string *buf, T v) {
+    buf->append(reinterpret_cast<const char*>(&v), sizeof(T));
+}
+
+void put_bytes(std::string *buf, const std::string &s) {
+    put<uint32_t>(buf, s.size());
+    buf->append(s);
+}
+
+// Returns body length of the frame starting at pos, 0 if it is not
+// complete yet, -1 if the length is invalid.
+int64_t frame_ready(const std::string &buf, size_t pos) {
+    uint32_t len;
+    if (buf.size() - pos < sizeof(len))
+        return 0;
+    memcpy(&len, buf.data() + pos, sizeof(len));
+    if (len == 0 || len > MAX_FRAME)
+        return -1;
+    return buf.size() - pos - sizeof(len) < len ? 0 : len;
+}
+
+void begin_frame(std::string *buf, size_t *start, size_t nops) {
+    *start = buf->size();
+    put<uint32_t>(buf, 0);  // patched by end_frame
+    put<uint16_t>(buf, nops);
+}
+
+void end_frame(std::string *buf, size_t start) {
+    uint32_t len = buf->size() - start - sizeof(len);
+    memcpy(&(*buf)[start], &len, sizeof(len));
+}
+
+void encode_request(const std::vector<Op> &ops, std::string *buf) {
+    size_t start;
+    begin_frame(buf, &start, ops.size());
+    for (auto &op : ops) {
+        put<uint8_t>(buf, static_cast<uint8_t>(op.type));
+        put<int64_t>(buf, op.doc.id);
+        put_bytes(buf, op.doc.data);
+    }
+    end_frame(buf, start);
+}
+
+int decode_request(const char *body, size_t size, std::vector<Op> *ops) {
+    Reader r(body, size);
+    uint16_t nops;
+    if (!r.get(&nops))
+        return -1;
+    ops->resize(nops);
+    for (auto &op : *ops) {
+        uint8_t type;
+        if (!r.get(&type) || (type > static_cast<uint8_t>(OpType::REMOVE) &&
+                              type != static_cast<uint8_t>(STATS)) ||
+            !r.get(&op.doc.id) || !r.get_bytes(&op.doc.data))
+            return -1;
+        op.type = static_cast<OpType>(type);
+        op.ret = -1;
+    }
+    return r.done() ? 0 : -1;
+}
+
+void encode_response(const std::vector<Op> &ops, std::string *buf) {
+    size_t start;
+    begin_frame(buf, &start, ops.size());
+    for (auto &op : ops) {
+        put<int32_t>(buf, op.ret);
+        put_bytes(buf, op.type == OpType::GET || op.type == STATS ?
+                       op.doc.data : "");
+    }
+    end_frame(buf, start);
+}
+
+int decode_response(const char *body, size_t size, std::vector<Op> *ops) {
+    Reader r(body, size);
+    uint16_t nops;
+    if (!r.get(&nops) || nops != ops->size())
+        return -1;
+    for (auto &op : *ops) {
+        int32_t ret;
+        if (!r.get(&ret) || !r.get_bytes(&op.doc.data))
+            return -1;
+        op.ret = ret;
+    }
+    return r.done() ? 0 : -1;
+}
+
+}  // namespace proto
+
+#endif  // SERVER_PROTOCOL_H_
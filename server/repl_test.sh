@@ -0,0 +1,42 @@
+#!/bin/sh
+# Replication test on localhost: a primary and a replica in their own
+# directories. The replica joins after the primary's small mutation log
+# has overflowed (snapshot catch-up), then follows the log. Both data sets
+# are exported and compared once the replica has caught up.
+set -e
+BIN=$(pwd)
+PORT=${REPL_PORT:-7412}
+T=$(mktemp -d)
+mkdir "$T/p" "$T/r"
+cleanup() {
+    kill "$P" "$R" 2>/dev/null || true
+    wait 2>/dev/null || true
+    rm -rf "$T"
+}
+trap cleanup EXIT
+
+"$BIN/docdb_server" -D "$T/p" -u "$T/p.sock" -R "127.0.0.1:$PORT" \
+    -L 65536 > /dev/null &
+P=$!
+"$BIN/docdb_bench" -u "$T/p.sock" -c 4 -f 500 -b 16 -k 4000
+"$BIN/docdb_server" -D "$T/r" -u "$T/r.sock" -F "127.0.0.1:$PORT" \
+    > /dev/null &
+R=$!
+"$BIN/docdb_bench" -u "$T/p.sock" -c 4 -f 500 -b 16 -k 4000 -o 100000
+
+SEQ=$("$BIN/docdb_bench" -u "$T/p.sock" -S | sed 's/.*seq=\([0-9]*\).*/\1/')
+for i in $(seq 100); do
+    STATS=$("$BIN/docdb_bench" -u "$T/r.sock" -S)
+    case "$STATS" in *"applied=$SEQ "*) break ;; esac
+    sleep 0.1
+done
+echo "primary: $("$BIN/docdb_bench" -u "$T/p.sock" -S)"
+echo "replica: $STATS"
+case "$STATS" in *"applied=$SEQ "*) ;; *) echo "replica lags"; exit 1 ;; esac
+
+kill "$P" "$R"
+wait
+(cd "$T/p" && "$BIN/docdb_bulk" export ../p.out > /dev/null)
+(cd "$T/r" && "$BIN/docdb_bulk" export ../r.out > /dev/null)
+cmp "$T/p.out" "$T/r.out"
+echo "replica matches primary ($(wc -c < "$T/p.out") bytes)"
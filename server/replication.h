@@ -0,0 +1,326 @@
+#ifndef SERVER_REPLICATION_H_
+#define SERVER_REPLICATION_H_
+/*
+MIT License
+
+Copyright (c) 2019 Konstantin Belyavskiy
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "docdb.h"
+#include "protocol.h"
+
+// Asynchronous log shipping. A replica connects to the primary's
+// replication port and sends HELLO (u64 epoch, u64 applied seq). If the
+// epoch matches and the primary still keeps the records after that seq,
+// they are streamed, otherwise a SNAPSHOT of the .db files comes first:
+//   SNAPSHOT := u8 1, u64 epoch, u64 seq, u64 size, bulk stream[size]
+//   RECORDS  := u8 2, u64 head, u32 n, n * (u64 seq, u8 type, i64 id,
+//               u32 len, data[len])
+// RECORDS with n = 0 are heartbeats. The replica answers every RECORDS
+// with an ACK (u64 applied seq). The epoch is chosen at primary startup,
+// since seqs restart with the process.
+
+namespace repl {
+
+const uint8_t MSG_SNAPSHOT = 1;
+const uint8_t MSG_RECORDS = 2;
+const size_t BATCH_BYTES = 1 << 20;
+const int HEARTBEAT_MS = 100;
+const int RETRY_MS = 200;
+
+bool read_full(int fd, void *buf, size_t size) {
+    char *p = static_cast<char*>(buf);
+    while (size > 0) {
+        ssize_t n = read(fd, p, size);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool write_full(int fd, const void *buf, size_t size) {
+    const char *p = static_cast<const char*>(buf);
+    while (size > 0) {
+        ssize_t n = write(fd, p, size);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+template <typename T> bool read_int(int fd, T *v) {
+    return read_full(fd, v, sizeof(T));
+}
+
+// Replication state of this process, reported by the STATS op
+struct Stats {
+    std::atomic<bool> replica{false};
+    std::atomic<uint64_t> applied{0};  // replica: last applied primary seq
+    std::atomic<uint64_t> head{0};  // replica: primary head seen last
+    std::atomic<uint64_t> applied_ops{0};
+    std::atomic<uint64_t> ops_per_sec{0};
+    std::atomic<uint64_t> snapshots{0};
+    std::mutex mtx;
+    std::map<int, uint64_t> acked;  // primary: follower fd -> acked seq
+
+    std::string format(DocumentDB &db) {
+        std::ostringstream out;
+        if (replica) {
+            out << "role=replica applied=" << applied << " head=" << head
+                << " lag=" << (head > applied ? head - applied : 0)
+                << " apply_ops_per_sec=" << ops_per_sec
+                << " snapshots=" << snapshots;
+            return out.str();
+        }
+        uint64_t seq = db.log_head(), lag = 0;
+        std::lock_guard<std::mutex> l(mtx);
+        for (auto &it : acked)
+            lag = std::max(lag, seq > it.second ? seq - it.second : 0);
+        out << "role=primary seq=" << seq << " followers=" << acked.size()
+            << " lag=" << lag << " snapshots=" << snapshots;
+        return out.str();
+    }
+};
+
+class Primary {
+ public:
+    Primary(DocumentDB &db, Stats &stats, const std::atomic<bool> &stopping)
+        : db(db), stats(stats), stopping(stopping),
+          epoch(std::random_device()() | 1ULL << 32) {}
+    void serve(int fd);
+ private:
+    bool send_snapshot(int fd, uint64_t *seq);
+    DocumentDB &db;
+    Stats &stats;
+    const std::atomic<bool> &stopping;
+    uint64_t epoch;
+};
+
+bool Primary::send_snapshot(int fd, uint64_t *seq) {
+    std::string tmp = "snapshot." + std::to_string(fd) + ".tmp";
+    std::fstream file(tmp, std::ios::in | std::ios::out | std::ios::binary |
+                           std::ios::trunc);
+    bool ok = file && db.snapshot(file, seq) == 0;
+    uint64_t size = file.tellp();
+    std::string hdr;
+    proto::put<uint8_t>(&hdr, MSG_SNAPSHOT);
+    proto::put<uint64_t>(&hdr, epoch);
+    proto::put<uint64_t>(&hdr, *seq);
+    proto::put<uint64_t>(&hdr, size);
+    ok = ok && write_full(fd, hdr.data(), hdr.size());
+    file.seekg(0);
+    char chunk[64 << 10];
+    while (ok && size > 0) {
+        size_t n = std::min<uint64_t>(size, sizeof(chunk));
+        ok = file.read(chunk, n) && write_full(fd, chunk, n);
+        size -= n;
+    }
+    file.close();
+    remove(tmp.c_str());
+    stats.snapshots++;
+    return ok;
+}
+
+// One thread per replica connection
+void Primary::serve(int fd) {
+    uint64_t their_epoch, from;
+    bool ok = read_int(fd, &their_epoch) && read_int(fd, &from);
+    if (ok && their_epoch != epoch)
+        ok = send_snapshot(fd, &from);
+    std::vector<LogRecord> recs;
+    std::string out;
+    while (ok && !stopping) {
+        uint64_t head;
+        recs.clear();
+        if (db.read_log(from, BATCH_BYTES, HEARTBEAT_MS, &recs, &head) != 0) {
+            ok = send_snapshot(fd, &from);  // replica fell behind
+            continue;
+        }
+        out.clear();
+        proto::put<uint8_t>(&out, MSG_RECORDS);
+        proto::put<uint64_t>(&out, head);
+        proto::put<uint32_t>(&out, recs.size());
+        for (auto &rec : recs) {
+            proto::put<uint64_t>(&out, rec.seq);
+            proto::put<uint8_t>(&out, static_cast<uint8_t>(rec.op.type));
+            proto::put<int64_t>(&out, rec.op.doc.id);
+            proto::put_bytes(&out, rec.op.doc.data);
+        }
+        if (!recs.empty())
+            from = recs.back().seq;
+        ok = write_full(fd, out.data(), out.size());
+        uint64_t acked;
+        while (ok && recv(fd, &acked, sizeof(acked), MSG_DONTWAIT | MSG_PEEK)
+                         == sizeof(acked) && read_int(fd, &acked)) {
+            std::lock_guard<std::mutex> l(stats.mtx);
+            stats.acked[fd] = acked;
+        }
+    }
+    std::lock_guard<std::mutex> l(stats.mtx);
+    stats.acked.erase(fd);
+    close(fd);
+}
+
+class Replica {
+ public:
+    Replica(DocumentDB &db, Stats &stats, const std::atomic<bool> &stopping)
+        : db(db), stats(stats), stopping(stopping) {}
+    // Follow the primary until stopping, reconnecting on errors
+    void run(std::function<int()> connect);
+ private:
+    bool follow(int fd);
+    bool load_snapshot(int fd);
+    bool apply_records(int fd);
+    void update_rate();
+    DocumentDB &db;
+    Stats &stats;
+    const std::atomic<bool> &stopping;
+    uint64_t epoch = 0;
+    uint64_t rate_ops = 0;
+    std::chrono::steady_clock::time_point rate_since =
+        std::chrono::steady_clock::now();
+};
+
+void Replica::run(std::function<int()> connect) {
+    while (!stopping) {
+        int fd = connect();
+        if (fd != -1) {
+            follow(fd);
+            close(fd);
+        }
+        if (!stopping)
+            std::this_thread::sleep_for(std::chrono::milliseconds(RETRY_MS));
+    }
+}
+
+bool Replica::follow(int fd) {
+    uint64_t applied = stats.applied;
+    if (!write_full(fd, &epoch, sizeof(epoch)) ||
+        !write_full(fd, &applied, sizeof(applied)))
+        return false;
+    while (!stopping) {
+        uint8_t kind;
+        if (!read_int(fd, &kind))
+            return false;
+        if (kind == MSG_SNAPSHOT && !load_snapshot(fd))
+            return false;
+        if (kind == MSG_RECORDS && !apply_records(fd))
+            return false;
+        if (kind != MSG_SNAPSHOT && kind != MSG_RECORDS)
+            return false;
+        update_rate();
+    }
+    return true;
+}
+
+bool Replica::load_snapshot(int fd) {
+    uint64_t seq, size;
+    if (!read_int(fd, &epoch) || !read_int(fd, &seq) || !read_int(fd, &size))
+        return false;
+    std::string tmp = "snapshot.tmp";
+    std::fstream file(tmp, std::ios::in | std::ios::out | std::ios::binary |
+                           std::ios::trunc);
+    char chunk[64 << 10];
+    bool ok = static_cast<bool>(file);
+    while (ok && size > 0) {
+        size_t n = std::min<uint64_t>(size, sizeof(chunk));
+        ok = read_full(fd, chunk, n) && file.write(chunk, n);
+        size -= n;
+    }
+    file.seekg(0);
+    ok = ok && db.restore(file) == 0;
+    file.close();
+    remove(tmp.c_str());
+    if (!ok) {
+        epoch = 0;  // ask for a new snapshot next time
+        std::cerr << "replica: can't load snapshot" << std::endl;
+        return false;
+    }
+    stats.applied = seq;
+    if (stats.head < seq)
+        stats.head = seq;
+    stats.snapshots++;
+    return true;
+}
+
+bool Replica::apply_records(int fd) {
+    uint64_t head, seq = stats.applied;
+    uint32_t n;
+    if (!read_int(fd, &head) || !read_int(fd, &n))
+        return false;
+    std::vector<Op> ops(n);
+    for (auto &op : ops) {
+        uint8_t type;
+        uint32_t len;
+        if (!read_int(fd, &seq) || !read_int(fd, &type) ||
+            !read_int(fd, &op.doc.id) || !read_int(fd, &len))
+            return false;
+        op.type = static_cast<OpType>(type);
+        op.doc.data.resize(len);
+        if (len && !read_full(fd, &op.doc.data[0], len))
+            return false;
+    }
+    db.batch(&ops);
+    stats.applied = seq;
+    stats.head = head;
+    stats.applied_ops += n;
+    return write_full(fd, &seq, sizeof(seq));
+}
+
+void Replica::update_rate() {
+    auto now = std::chrono::steady_clock::now();
+    double sec = std::chrono::duration<double>(now - rate_since).count();
+    if (sec < 1)
+        return;
+    uint64_t ops = stats.applied_ops;
+    stats.ops_per_sec = (ops - rate_ops) / sec;
+    rate_ops = ops;
+    rate_since = now;
+}
+
+}  // namespace repl
+
+#endif  // SERVER_REPLICATION_H_
@@ -0,0 +1,476 @@
+/*
+MIT License
+
+Copyright (c) 2019 Konstantin Belyavskiy
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <list>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "docdb.h"
+#include "protocol.h"
+#include "replication.h"
+
+// docdb_server serves the engine over TCP or a Unix socket. Every core
+// runs its own epoll loop; all loops share one listening socket
+// (EPOLLEXCLUSIVE), each connection stays on the loop that accepted it.
+// With -R it also ships its mutation log to replicas, with -F it is a
+// read-only replica of another server (see replication.h).
+
+const int MAX_EVENTS = 256;
+const size_t READ_CHUNK = 64 << 10;
+const size_t READ_BUDGET = 16 * READ_CHUNK;  // per wakeup, for fairness
+// stop reading and running frames while more output is queued
+const size_t OUT_LIMIT = 4 << 20;
+const int READ_ONLY = -2;  // ret of writes sent to a replica
+
+std::atomic<bool> stopping(false);
+
+void on_signal(int) {
+    stopping = true;
+}
+
+int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags == -1 ? -1 : fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+int listen_tcp(const std::string &addr) {
+    size_t colon = addr.rfind(':');
+    if (colon == std::string::npos)
+        return -1;
+    std::string host = addr.substr(0, colon), port = addr.substr(colon + 1);
+    struct addrinfo hints = {}, *res;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    if (getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(),
+                    &hints, &res) != 0)
+        return -1;
+    int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    int one = 1;
+    if (fd != -1 &&
+        (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0 ||
+         bind(fd, res->ai_addr, res->ai_addrlen) != 0)) {
+        close(fd);
+        fd = -1;
+    }
+    if (fd == -1)
+        perror("listen_tcp");
+    freeaddrinfo(res);
+    return fd;
+}
+
+int connect_tcp(const std::string &addr) {
+    size_t colon = addr.rfind(':');
+    struct addrinfo hints = {}, *res;
+    hints.ai_socktype = SOCK_STREAM;
+    if (colon == std::string::npos ||
+        getaddrinfo(addr.substr(0, colon).c_str(),
+                    addr.substr(colon + 1).c_str(), &hints, &res) != 0)
+        return -1;
+    int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (fd != -1 && connect(fd, res->ai_addr, res->ai_addrlen) != 0) {
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+int listen_unix(const std::string &path) {
+    struct sockaddr_un sa = {};
+    if (path.size() >= sizeof(sa.sun_path))
+        return -1;
+    sa.sun_family = AF_UNIX;
+    memcpy(sa.sun_path, path.c_str(), path.size());
+    unlink(path.c_str());
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd != -1 &&
+        bind(fd, reinterpret_cast<struct sockaddr*>(&sa), sizeof(sa)) != 0) {
+        close(fd);
+        fd = -1;
+    }
+    if (fd == -1)
+        perror("listen_unix");
+    return fd;
+}
+
+struct Conn {
+    std::string in;
+    std::string out;
+    size_t out_pos = 0;
+    uint32_t events = 0;
+    bool eof = false;  // peer is done sending, close once out is drained
+};
+
+size_t queued(const Conn *c) {
+    return c->out.size() - c->out_pos;
+}
+
+class Loop {
+ public:
+    Loop(int listen_fd, bool tcp, DocumentDB &db, repl::Stats &stats)
+        : listen_fd(listen_fd), tcp(tcp), db(db), stats(stats) {}
+    int run();
+ private:
+    void on_accept();
+    void on_read(int fd, Conn *c);
+    bool pump(int fd, Conn *c);
+    int process(Conn *c);
+    void execute();
+    bool flush(int fd, Conn *c);
+    void watch(int fd, Conn *c);
+    void close_conn(int fd);
+    int listen_fd;
+    bool tcp;
+    DocumentDB &db;
+    repl::Stats &stats;
+    int epfd = -1;
+    std::unordered_map<int, Conn> conns;
+    std::vector<Op> ops, reads;
+};
+
+int Loop::run() {
+    epfd = epoll_create1(0);
+    struct epoll_event ev = {}, events[MAX_EVENTS];
+    ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+    ev.data.fd = listen_fd;
+    if (epfd == -1 || epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &ev) != 0) {
+        perror("epoll");
+        return -1;
+    }
+    while (!stopping) {
+        int n = epoll_wait(epfd, events, MAX_EVENTS, 100);
+        if (n == -1 && errno != EINTR) {
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            if (fd == listen_fd) {
+                on_accept();
+                continue;
+            }
+            auto it = conns.find(fd);
+            if (it == conns.end())
+                continue;
+            Conn *c = &it->second;
+            if (events[i].events & (EPOLLERR | EPOLLHUP) &&
+                !(events[i].events & EPOLLIN)) {
+                close_conn(fd);
+                continue;
+            }
+            if (events[i].events & EPOLLOUT && !pump(fd, c)) {
+                close_conn(fd);
+                continue;
+            }
+            if (events[i].events & EPOLLIN)
+                on_read(fd, c);
+        }
+    }
+    while (!conns.empty())
+        close_conn(conns.begin()->first);
+    close(epfd);
+    return 0;
+}
+
+void Loop::on_accept() {
+    int fd;
+    while ((fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK)) != -1) {
+        if (tcp) {
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+        Conn *c = &conns[fd];
+        struct epoll_event ev = {};
+        ev.events = c->events = EPOLLIN;
+        ev.data.fd = fd;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+            perror("epoll_ctl");
+            conns.erase(fd);
+            close(fd);
+        }
+    }
+}
+
+// Level triggered: whatever is left over the budget wakes us up again
+void Loop::on_read(int fd, Conn *c) {
+    for (size_t total = 0; total < READ_BUDGET; ) {
+        size_t size = c->in.size();
+        c->in.resize(size + READ_CHUNK);
+        ssize_t n = read(fd, &c->in[size], READ_CHUNK);
+        c->in.resize(size + (n > 0 ? n : 0));
+        if (n > 0) {
+            total += n;
+            continue;
+        }
+        if (n == -1 && errno == EINTR)
+            continue;
+        c->eof = n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+        break;
+    }
+    if (!pump(fd, c))
+        close_conn(fd);
+}
+
+// Run buffered frames and send responses while less than OUT_LIMIT is
+// queued, frames left over wait for EPOLLOUT. Returns false if the
+// connection should be closed.
+bool Loop::pump(int fd, Conn *c) {
+    int ret;
+    do {
+        ret = process(c);
+        if (ret < 0 || !flush(fd, c))
+            return false;
+    } while (ret > 0 && queued(c) < OUT_LIMIT);
+    if (c->eof && ret == 0 && queued(c) == 0)
+        return false;  // all answered
+    watch(fd, c);
+    return true;
+}
+
+// Execute complete frames of the input buffer in order, until OUT_LIMIT
+// is queued. Returns 1 if frames are left, -1 on protocol errors.
+int Loop::process(Conn *c) {
+    size_t pos = 0;
+    int64_t len;
+    while (queued(c) < OUT_LIMIT &&
+           (len = proto::frame_ready(c->in, pos)) > 0) {
+        const char *body = c->in.data() + pos + sizeof(uint32_t);
+        if (proto::decode_request(body, len, &ops) != 0)
+            return -1;
+        execute();
+        proto::encode_response(ops, &c->out);
+        pos += sizeof(uint32_t) + len;
+    }
+    c->in.erase(0, pos);
+    len = proto::frame_ready(c->in, 0);
+    return len < 0 ? -1 : len > 0;
+}
+
+void Loop::execute() {
+    if (ops.size() == 1 && ops[0].type == proto::STATS) {
+        ops[0].doc.data = stats.format(db);
+        ops[0].ret = 0;
+        return;
+    }
+    if (!stats.replica) {
+        db.batch(&ops);
+        return;
+    }
+    reads.clear();  // replicas only serve reads, writes come from the log
+    for (auto &op : ops)
+        if (op.type == OpType::GET || op.type == OpType::EXISTS)
+            reads.push_back(op);
+        else
+            op.ret = READ_ONLY;
+    db.batch(&reads);
+    auto read = reads.begin();
+    for (auto &op : ops)
+        if (op.type == OpType::GET || op.type == OpType::EXISTS)
+            op = std::move(*read++);
+}
+
+// Accept replicas on the replication port, one shipping thread each,
+// joined once its replica is gone so reconnects don't pile them up
+void serve_replicas(int listen_fd, repl::Primary *primary) {
+    struct Shipper {
+        std::thread thread;
+        std::atomic<bool> done{false};
+    };
+    std::list<Shipper> shippers;
+    while (!stopping) {
+        for (auto it = shippers.begin(); it != shippers.end();) {
+            if (!it->done) {
+                ++it;
+                continue;
+            }
+            it->thread.join();
+            it = shippers.erase(it);
+        }
+        struct pollfd pfd = {listen_fd, POLLIN, 0};
+        if (poll(&pfd, 1, 100) <= 0)
+            continue;
+        int fd = accept(listen_fd, nullptr, nullptr);
+        if (fd == -1)
+            continue;
+        shippers.emplace_back();
+        Shipper *s = &shippers.back();
+        s->thread = std::thread([primary, fd, s]() {
+            primary->serve(fd);
+            s->done = true;
+        });
+    }
+    for (auto &s : shippers)
+        s.thread.join();
+}
+
+// Write queued output, returns false on errors
+bool Loop::flush(int fd, Conn *c) {
+    while (c->out_pos < c->out.size()) {
+        ssize_t n = write(fd, c->out.data() + c->out_pos,
+                          c->out.size() - c->out_pos);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (n == -1)
+            return false;
+        c->out_pos += n;
+    }
+    if (c->out_pos == c->out.size()) {
+        c->out.clear();
+        c->out_pos = 0;
+    }
+    return true;
+}
+
+// Wait for EPOLLOUT while output is queued, pause input above OUT_LIMIT
+void Loop::watch(int fd, Conn *c) {
+    uint32_t events = (queued(c) ? EPOLLOUT : 0) |
+                      (queued(c) < OUT_LIMIT && !c->eof ? EPOLLIN : 0);
+    if (events == c->events)
+        return;
+    struct epoll_event ev = {};
+    ev.events = c->events = events;
+    ev.data.fd = fd;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+void Loop::close_conn(int fd) {
+    epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+    close(fd);
+    conns.erase(fd);
+}
+
+int usage() {
+    std::cerr << "usage: docdb_server (-t [host]:port | -u path) "
+              << "[-n threads] [-w] [-z] [-D dir]\n"
+              << "                    [-R [host]:port [-L log_bytes] | "
+              << "-F host:port]\n"
+              << "  -w  enable write-back mode\n"
+              << "  -z  store records compressed\n"
+              << "  -D  change to dir first, the db lives in dir/db\n"
+              << "  -R  ship the mutation log to replicas on this port\n"
+              << "  -L  mutation log size kept in memory (64MB)\n"
+              << "  -F  run as a read-only replica of this primary\n";
+    return 1;
+}
+
+int main(int argc, char *argv[]) {
+    std::string tcp_addr, unix_path, repl_addr, primary_addr;
+    unsigned nthreads = std::thread::hardware_concurrency();
+    bool write_back = false, compression = false;
+    size_t log_bytes = 64 << 20;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:u:n:wzD:R:L:F:")) != -1) {
+        switch (opt) {
+        case 't': tcp_addr = optarg; break;
+        case 'u': unix_path = optarg; break;
+        case 'n': nthreads = strtoul(optarg, nullptr, 10); break;
+        case 'w': write_back = true; break;
+        case 'z': compression = true; break;
+        case 'D':
+            if (chdir(optarg) != 0) {
+                perror("chdir");
+                return 1;
+            }
+            break;
+        case 'R': repl_addr = optarg; break;
+        case 'L': log_bytes = strtoull(optarg, nullptr, 10); break;
+        case 'F': primary_addr = optarg; break;
+        default: return usage();
+        }
+    }
+    if (tcp_addr.empty() == unix_path.empty() ||
+        (!repl_addr.empty() && !primary_addr.empty()))
+        return usage();
+    if (nthreads == 0)
+        nthreads = 1;
+    int fd = tcp_addr.empty() ? listen_unix(unix_path) : listen_tcp(tcp_addr);
+    if (fd == -1 || set_nonblocking(fd) != 0 || listen(fd, SOMAXCONN) != 0) {
+        std::cerr << "can't listen on " << tcp_addr << unix_path << std::endl;
+        return 1;
+    }
+    int repl_fd = repl_addr.empty() ? -1 : listen_tcp(repl_addr);
+    if (!repl_addr.empty() && (repl_fd == -1 || listen(repl_fd, 16) != 0)) {
+        std::cerr << "can't listen on " << repl_addr << std::endl;
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    DocumentDB &db = get_instance();
+    db.set_write_back(write_back);
+    db.set_compression(compression);
+    repl::Stats stats;
+    repl::Primary primary(db, stats, stopping);
+    repl::Replica replica(db, stats, stopping);
+    std::vector<std::thread> threads;
+    if (repl_fd != -1) {
+        db.set_log_capacity(log_bytes);
+        threads.emplace_back(serve_replicas, repl_fd, &primary);
+    }
+    if (!primary_addr.empty()) {
+        stats.replica = true;
+        threads.emplace_back([&replica, &primary_addr]() {
+            replica.run([&primary_addr]() {
+                return connect_tcp(primary_addr);
+            });
+        });
+    }
+    for (unsigned i = 0; i < nthreads; i++)
+        threads.emplace_back([fd, &tcp_addr, &db, &stats]() {
+            Loop(fd, !tcp_addr.empty(), db, stats).run();
+        });
+    std::cout << "listening on " << tcp_addr << unix_path << " with "
+              << nthreads << " loops" << std::endl;
+    for (auto &t : threads)
+        t.join();
+    close(fd);
+    if (repl_fd != -1)
+        close(repl_fd);
+    if (!unix_path.empty())
+        unlink(unix_path.c_str());
+    db.set_write_back(false);
+    return 0;
+}
@@ -0,0 +1,66 @@
+/*
+MIT License
+
+Copyright (c) 2019 Konstantin Belyavskiy
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+#include "docdb.h"
+
+// Restore or dump the database in ./db using the bulk stream format.
+//   docdb_bulk load <file> [mem_mb]
+//   docdb_bulk export <file>
+
+int usage() {
+    std::cerr << "usage: docdb_bulk load <file> [mem_mb]\n"
+              << "       docdb_bulk export <file>\n";
+    return 1;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3)
+        return usage();
+    std::string cmd = argv[1];
+    DocumentDB& db = get_instance();
+    if (cmd == "load") {
+        size_t mem_mb = argc > 3 ? strtoull(argv[3], nullptr, 10) : 256;
+        if (mem_mb == 0)
+            return usage();
+        std::ifstream in(argv[2], std::ios::binary);
+        if (!in || db.bulk_load(in, mem_mb << 20) != 0) {
+            std::cerr << "load failed: " << argv[2] << std::endl;
+            return 1;
+        }
+    } else if (cmd == "export") {
+        std::ofstream out(argv[2], std::ios::binary | std::ios::trunc);
+        if (!out || db.bulk_export(out) != 0) {
+            std::cerr << "export failed: " << argv[2] << std::endl;
+            return 1;
+        }
+    } else {
+        return usage();
+    }
+    return 0;
+}